@@ -22,6 +22,9 @@
 #include <linux/of_reserved_mem.h>
 #include <linux/ioctl.h>
 #include <linux/platform_device.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/firmware/qcom/qcom_scm.h>
 #include <dt-bindings/firmware/qcom,scm.h>
 #include <sound/soc.h>
@@ -81,8 +84,19 @@ struct msm_audio_fd_data {
 	struct device *dev;
 	struct list_head list;
 	bool hyp_assign;
+	/* held by the mapping itself and by each DSP memory map using it */
+	refcount_t refs;
+	/* unmapped by its owner, no longer found by fd */
+	bool detached;
+	struct list_head release;
 };
 
+/* Entries whose last reference went away in atomic context */
+static DEFINE_SPINLOCK(msm_audio_mem_release_lock);
+static LIST_HEAD(msm_audio_mem_release_list);
+static void msm_audio_mem_release_work(struct work_struct *work);
+static DECLARE_WORK(msm_audio_mem_release_wk, msm_audio_mem_release_work);
+
 static void msm_audio_mem_add_allocation(
 	struct msm_audio_mem_private *msm_audio_mem_data,
 	struct msm_audio_alloc_data *alloc_data)
@@ -370,7 +384,8 @@ static void msm_audio_update_fd_list(struct msm_audio_fd_data *msm_audio_fd_data
 	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
 	list_for_each_entry(msm_audio_fd_data1,
 			&msm_audio_mem_fd_list.fd_list, list) {
-		if (msm_audio_fd_data1->fd == msm_audio_fd_data->fd) {
+		if (!msm_audio_fd_data1->detached &&
+		    msm_audio_fd_data1->fd == msm_audio_fd_data->fd) {
 			pr_err("%s fd already present, not updating the list\n",
 				__func__);
 			mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
@@ -381,27 +396,6 @@ static void msm_audio_update_fd_list(struct msm_audio_fd_data *msm_audio_fd_data
 	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
 }
 
-static void msm_audio_delete_fd_entry(void *handle)
-{
-	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
-	struct list_head *ptr, *next;
-
-	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
-	list_for_each_safe(ptr, next,
-			&msm_audio_mem_fd_list.fd_list) {
-		msm_audio_fd_data = list_entry(ptr, struct msm_audio_fd_data,
-					list);
-		if (msm_audio_fd_data->handle == handle) {
-			pr_debug("%s deleting handle %pK entry from list\n",
-				__func__, handle);
-			list_del(&(msm_audio_fd_data->list));
-			kfree(msm_audio_fd_data);
-			break;
-		}
-	}
-	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
-}
-
 int msm_audio_get_phy_addr(int fd, dma_addr_t *paddr, size_t *pa_len)
 {
 	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
@@ -415,7 +409,7 @@ int msm_audio_get_phy_addr(int fd, dma_addr_t *paddr, size_t *pa_len)
 	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
 	list_for_each_entry(msm_audio_fd_data,
 			&msm_audio_mem_fd_list.fd_list, list) {
-		if (msm_audio_fd_data->fd == fd) {
+		if (!msm_audio_fd_data->detached && msm_audio_fd_data->fd == fd) {
 			*paddr = msm_audio_fd_data->paddr;
 			*pa_len = msm_audio_fd_data->plen;
 			status = 0;
@@ -437,7 +431,7 @@ static int msm_audio_set_hyp_assign(int fd, bool assign)
 	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
 	list_for_each_entry(msm_audio_fd_data,
 			&msm_audio_mem_fd_list.fd_list, list) {
-		if (msm_audio_fd_data->fd == fd) {
+		if (!msm_audio_fd_data->detached && msm_audio_fd_data->fd == fd) {
 			status = 0;
 			pr_debug("%s Found fd %d\n", __func__, fd);
 			msm_audio_fd_data->hyp_assign = assign;
@@ -449,23 +443,6 @@ static int msm_audio_set_hyp_assign(int fd, bool assign)
 	return status;
 }
 
-static void msm_audio_get_handle(int fd, void **handle)
-{
-	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
-
-	pr_debug("%s fd %d\n", __func__, fd);
-	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
-	list_for_each_entry(msm_audio_fd_data,
-			&msm_audio_mem_fd_list.fd_list, list) {
-		if (msm_audio_fd_data->fd == fd) {
-			*handle = (struct dma_buf *)msm_audio_fd_data->handle;
-			pr_debug("%s handle %pK\n", __func__, *handle);
-			break;
-		}
-	}
-	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
-}
-
 /**
  * msm_audio_mem_import-
  *        Import MEM buffer with given file descriptor
@@ -575,30 +552,272 @@ static int msm_audio_hyp_unassign(struct msm_audio_fd_data *msm_audio_fd_data)
  *
  * To be called from machine driver.
  */
-void msm_audio_mem_crash_handler(void)
+/* Undo the hyp assignment and mapping of an entry, list_mutex held */
+static int msm_audio_mem_release_entry(struct msm_audio_fd_data *msm_audio_fd_data)
+{
+	struct msm_audio_mem_private *mem_data = dev_get_drvdata(msm_audio_fd_data->dev);
+	int ret = 0;
+
+	/*  clean if CMA was used*/
+	if (msm_audio_fd_data->hyp_assign)
+		msm_audio_hyp_unassign(msm_audio_fd_data);
+	if (msm_audio_fd_data->handle)
+		ret = msm_audio_mem_free(msm_audio_fd_data->handle, mem_data);
+	list_del(&(msm_audio_fd_data->list));
+	kfree(msm_audio_fd_data);
+
+	return ret;
+}
+
+/* Drop the reference of the mapping itself, list_mutex held */
+static int msm_audio_mem_detach(struct msm_audio_fd_data *msm_audio_fd_data)
+{
+	msm_audio_fd_data->detached = true;
+	if (!refcount_dec_and_test(&msm_audio_fd_data->refs))
+		return 0;
+
+	return msm_audio_mem_release_entry(msm_audio_fd_data);
+}
+
+static void msm_audio_mem_release_work(struct work_struct *work)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data, *next;
+	LIST_HEAD(release);
+
+	spin_lock_irq(&msm_audio_mem_release_lock);
+	list_splice_init(&msm_audio_mem_release_list, &release);
+	spin_unlock_irq(&msm_audio_mem_release_lock);
+
+	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
+	list_for_each_entry_safe(msm_audio_fd_data, next, &release, release)
+		msm_audio_mem_release_entry(msm_audio_fd_data);
+	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
+}
+
+/*
+ * Drop the mapping of @fd. Memory a DSP map still uses stays assigned
+ * until the map lets go of it.
+ */
+static int msm_audio_mem_unmap_fd(int fd)
 {
 	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
-	struct list_head *ptr, *next;
-	void *handle = NULL;
-	struct msm_audio_mem_private *mem_data = NULL;
+	int status = -EINVAL;
 
 	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
 	list_for_each_entry(msm_audio_fd_data,
+			&msm_audio_mem_fd_list.fd_list, list) {
+		if (!msm_audio_fd_data->detached && msm_audio_fd_data->fd == fd) {
+			status = msm_audio_mem_detach(msm_audio_fd_data);
+			break;
+		}
+	}
+	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
+
+	return status;
+}
+
+/**
+ * msm_audio_mem_crash_handler -
+ *        handles cleanup after userspace crashes.
+ *
+ * Buffers a DSP memory map still uses are released with the map.
+ *
+ * To be called from machine driver.
+ */
+void msm_audio_mem_crash_handler(void)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
+	struct msm_audio_fd_data *next = NULL;
+
+	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
+	list_for_each_entry_safe(msm_audio_fd_data, next,
 		&msm_audio_mem_fd_list.fd_list, list) {
-		handle = msm_audio_fd_data->handle;
-		mem_data = dev_get_drvdata(msm_audio_fd_data->dev);
-		/*  clean if CMA was used*/
-		if (msm_audio_fd_data->hyp_assign)
-			msm_audio_hyp_unassign(msm_audio_fd_data);
-		if (handle)
-			msm_audio_mem_free(handle, mem_data);
+		if (!msm_audio_fd_data->detached)
+			msm_audio_mem_detach(msm_audio_fd_data);
 	}
-	list_for_each_safe(ptr, next,
-		&msm_audio_mem_fd_list.fd_list) {
-		msm_audio_fd_data = list_entry(ptr, struct msm_audio_fd_data,
-						list);
-		list_del(&(msm_audio_fd_data->list));
-		kfree(msm_audio_fd_data);
+	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
+}
+
+/**
+ * msm_audio_mem_get_buf -
+ *        takes a reference to the buffer mapped under an fd
+ *
+ * @fd: file descriptor for the MEM memory, in the calling process
+ * @paddr: returns the physical address of the buffer
+ * @pa_len: returns the length of the buffer
+ *
+ * The fd numbers of the registry are only meaningful to the process
+ * that mapped them, so @fd must name the registered dma_buf in the
+ * calling process too. The reference keeps the mapping and its hyp
+ * assignment until msm_audio_mem_put_buf(), even if the owner unmaps
+ * it meanwhile.
+ *
+ * Returns the buffer, ERR_PTR(-EINVAL) if @fd is not mapped or
+ * ERR_PTR(-EBADF) if it names another buffer in the calling process
+ */
+void *msm_audio_mem_get_buf(int fd, dma_addr_t *paddr, size_t *pa_len)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
+	void *buf = ERR_PTR(-EINVAL);
+	struct dma_buf *dma_buf;
+
+	dma_buf = dma_buf_get(fd);
+	if (IS_ERR(dma_buf))
+		return ERR_CAST(dma_buf);
+
+	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
+	list_for_each_entry(msm_audio_fd_data,
+			&msm_audio_mem_fd_list.fd_list, list) {
+		if (msm_audio_fd_data->detached || msm_audio_fd_data->fd != fd)
+			continue;
+
+		if (msm_audio_fd_data->handle != dma_buf) {
+			buf = ERR_PTR(-EBADF);
+			break;
+		}
+		refcount_inc(&msm_audio_fd_data->refs);
+		*paddr = msm_audio_fd_data->paddr;
+		*pa_len = msm_audio_fd_data->plen;
+		buf = msm_audio_fd_data;
+		break;
+	}
+	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
+	dma_buf_put(dma_buf);
+
+	return buf;
+}
+
+/**
+ * msm_audio_mem_buf_addr -
+ *        returns where a buffer is mapped
+ *
+ * @buf: buffer returned by msm_audio_mem_get_buf(), still referenced
+ * @paddr: returns the physical address of the buffer
+ * @pa_len: returns the length of the buffer
+ */
+void msm_audio_mem_buf_addr(void *buf, dma_addr_t *paddr, size_t *pa_len)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = buf;
+
+	*paddr = msm_audio_fd_data->paddr;
+	*pa_len = msm_audio_fd_data->plen;
+}
+
+/**
+ * msm_audio_mem_hold_buf -
+ *        takes another reference to a buffer
+ *
+ * @buf: buffer returned by msm_audio_mem_get_buf(), still referenced
+ *
+ * May be called in atomic context.
+ */
+void msm_audio_mem_hold_buf(void *buf)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = buf;
+
+	refcount_inc(&msm_audio_fd_data->refs);
+}
+
+/**
+ * msm_audio_mem_read_buf -
+ *        copies out part of a buffer
+ *
+ * @buf: buffer returned by msm_audio_mem_get_buf(), still referenced
+ * @offset: offset of the data in the buffer
+ * @dst: kernel memory to copy to
+ * @len: number of bytes to copy
+ *
+ * Buffers hyp assigned to the DSP are not accessible to HLOS.
+ *
+ * Returns 0 on success or error on failure
+ */
+int msm_audio_mem_read_buf(void *buf, size_t offset, void *dst, size_t len)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = buf;
+	struct dma_buf *dma_buf = msm_audio_fd_data->handle;
+	struct iosys_map map;
+	int rc;
+
+	if (msm_audio_fd_data->hyp_assign)
+		return -EPERM;
+
+	if (offset > msm_audio_fd_data->plen ||
+	    len > msm_audio_fd_data->plen - offset)
+		return -EINVAL;
+
+	rc = dma_buf_begin_cpu_access(dma_buf, DMA_FROM_DEVICE);
+	if (rc)
+		return rc;
+
+	rc = dma_buf_vmap_unlocked(dma_buf, &map);
+	if (!rc) {
+		iosys_map_memcpy_from(dst, &map, offset, len);
+		dma_buf_vunmap_unlocked(dma_buf, &map);
+	}
+	dma_buf_end_cpu_access(dma_buf, DMA_FROM_DEVICE);
+
+	return rc;
+}
+
+/**
+ * msm_audio_mem_put_buf -
+ *        drops a reference taken by msm_audio_mem_get_buf()
+ *
+ * @buf: buffer returned by msm_audio_mem_get_buf()
+ *
+ * May be called in atomic context; the last reference releases the
+ * mapping from a work item.
+ */
+void msm_audio_mem_put_buf(void *buf)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = buf;
+	unsigned long flags;
+
+	if (!refcount_dec_and_test(&msm_audio_fd_data->refs))
+		return;
+
+	spin_lock_irqsave(&msm_audio_mem_release_lock, flags);
+	list_add_tail(&msm_audio_fd_data->release, &msm_audio_mem_release_list);
+	spin_unlock_irqrestore(&msm_audio_mem_release_lock, flags);
+	schedule_work(&msm_audio_mem_release_wk);
+}
+
+/**
+ * msm_audio_mem_ssr_reassign -
+ *        assigns the hyp assigned buffers to the DSP again after it
+ *        restarted
+ *
+ * The memory is reclaimed first in case the restart left it with the
+ * DSP, which makes the assignment from HLOS fail otherwise.
+ */
+void msm_audio_mem_ssr_reassign(void)
+{
+	struct msm_audio_fd_data *msm_audio_fd_data = NULL;
+	struct qcom_scm_vmperm dst_vmids_map[] = {{QCOM_SCM_VMID_LPASS, QCOM_SCM_PERM_RW},
+						 {QCOM_SCM_VMID_ADSP_HEAP, QCOM_SCM_PERM_RW}};
+	struct qcom_scm_vmperm dst_vmids_unmap[] = {{QCOM_SCM_VMID_HLOS, QCOM_SCM_PERM_RWX}};
+	u64 src_vmid_unmap_list;
+	u64 src_vmid_map_list;
+	int ret;
+
+	mutex_lock(&(msm_audio_mem_fd_list.list_mutex));
+	list_for_each_entry(msm_audio_fd_data,
+			&msm_audio_mem_fd_list.fd_list, list) {
+		if (!msm_audio_fd_data->hyp_assign)
+			continue;
+
+		src_vmid_unmap_list = BIT(QCOM_SCM_VMID_LPASS) | BIT(QCOM_SCM_VMID_ADSP_HEAP);
+		qcom_scm_assign_mem(msm_audio_fd_data->paddr, msm_audio_fd_data->plen,
+				&src_vmid_unmap_list, dst_vmids_unmap, ARRAY_SIZE(dst_vmids_unmap));
+
+		src_vmid_map_list = BIT(QCOM_SCM_VMID_HLOS);
+		ret = qcom_scm_assign_mem(msm_audio_fd_data->paddr, msm_audio_fd_data->plen,
+				&src_vmid_map_list, dst_vmids_map, ARRAY_SIZE(dst_vmids_map));
+		if (ret < 0) {
+			pr_err("%s: qcom assign failed result = %d addr = 0x%llx size = %zu\n",
+				__func__, ret, msm_audio_fd_data->paddr, msm_audio_fd_data->plen);
+			msm_audio_fd_data->hyp_assign = false;
+		}
 	}
 	mutex_unlock(&(msm_audio_mem_fd_list.list_mutex));
 }
@@ -667,16 +886,15 @@ static long msm_audio_mem_ioctl(struct file *file, unsigned int ioctl_num,
 		msm_audio_fd_data->paddr = paddr;
 		msm_audio_fd_data->plen = pa_len;
 		msm_audio_fd_data->dev = mem_data->cb_dev;
+		refcount_set(&msm_audio_fd_data->refs, 1);
 		msm_audio_update_fd_list(msm_audio_fd_data);
 		break;
 	case IOCTL_UNMAP_PHYS_ADDR:
-		msm_audio_get_handle((int)ioctl_param, &mem_handle);
-		ret = msm_audio_mem_free(mem_handle, mem_data);
+		ret = msm_audio_mem_unmap_fd((int)ioctl_param);
 		if (ret < 0) {
 			pr_err("%s Ion free failed %d\n", __func__, ret);
 			return ret;
 		}
-		msm_audio_delete_fd_entry(mem_handle);
 		break;
 	case IOCTL_MAP_HYP_ASSIGN:
 		ret = msm_audio_get_phy_addr((int)ioctl_param, &paddr, &pa_len);
@@ -890,6 +1108,7 @@ int q6apm_audio_mem_init(void)
 void q6apm_audio_mem_exit(void)
 {
 	    platform_driver_unregister(&q6apm_audio_mem_platform_driver);
+	    flush_work(&msm_audio_mem_release_wk);
 }
 
 MODULE_DESCRIPTION("Q6APM audio mem driver");
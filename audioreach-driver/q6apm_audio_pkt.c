@@ -11,15 +11,30 @@
 #include <linux/of.h>
 #include <linux/of_platform.h>
 #include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/refcount.h>
 #include <linux/device.h>
 #include <linux/skbuff.h>
+#include <linux/sizes.h>
 #include <linux/cdev.h>
-#include <linux/idr.h>
+#include <linux/capability.h>
+#include <linux/completion.h>
+#include <linux/semaphore.h>
+#include <linux/dma-buf.h>
+#include <linux/eventfd.h>
+#include <linux/iosys-map.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/hrtimer.h>
+#include <linux/io_uring/cmd.h>
 #include <linux/of.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/termios.h>
 #include <linux/soc/qcom/apr.h>
 #include <linux/wait.h>
@@ -29,9 +44,27 @@
 #include "audioreach.h"
 #include "q6apm.h"
 #include "q6prm_audioreach.h"
+#include <linux/msm_audio.h>
+#include <dsp/spf-core.h>
 
 #define APM_CMD_SHARED_MEM_MAP_REGIONS          0x0100100C
+#define APM_CMD_SHARED_MEM_UNMAP_REGIONS        0x0100100D
+#define APM_CMD_RSP_SHARED_MEM_MAP_REGIONS      0x02001001
 #define APM_MEMORY_MAP_BIT_MASK_IS_OFFSET_MODE  0x00000004UL
+#define APM_CMD_REGISTER_MODULE_EVENTS          0x0100100E
+#define DATA_CMD_WR_SH_MEM_EP_EOS               0x04001002
+#define DATA_CMD_RSP_WR_SH_MEM_EP_EOS_RENDERED  0x05001001
+
+/* Most significant byte of a GPR opcode gives its class */
+#define GPR_OPCODE_CLASS(opcode)	((opcode) >> 24)
+#define GPR_OPCODE_CLASS_DATA_CMD	0x04
+#define GPR_OPCODE_CLASS_DATA_RSP	0x05
+#define GPR_OPCODE_CLASS_AUDIO_PKT_EVENT	GPR_OPCODE_CLASS(AUDIO_PKT_EVENT_DSP_DOWN)
+
+/* Tokens of stream buffers: stream id in bits 16-30, sequence below */
+#define AUDIO_PKT_STREAM_TOKEN		BIT(31)
+#define AUDIO_PKT_STREAM_ID_SHIFT	16
+#define AUDIO_PKT_STREAM_ID_MAX		0x7fff
 
 /* Define Logging Macros */
 static int audio_pkt_debug_mask;
@@ -52,35 +85,218 @@ do {										\
 }
 
 #define MODULE_NAME "audio-pkt"
-#define MINOR_NUMBER_COUNT 1
-#define AUDPKT_DRIVER_NAME "aud_pasthru_adsp"
+/* One minor per GPR domain id, each DSP gets its own device */
+#define AUDIO_PKT_MAX_DOMAINS 8
+#define AUDPKT_DRIVER_NAME "aud_pasthru"
 #define CHANNEL_NAME "to_apps"
 #define APM_AUDIO_DRV_NAME "q6apm-audio-pkt"
+#define AUDIO_PKT_SEND_WAIT_TIMEOUT_MS 2000
+#define AUDIO_PKT_GRAPH_CLOSE_TIMEOUT_MS 20000
+#define AUDIO_PKT_TOKEN_REAP_INTERVAL_MS 5000
+/* Delay before retrying a send the transport refused as congested */
+#define AUDIO_PKT_TX_RETRY_MS 1
+/* Bytes of control commands a transmit queue may send per unit of weight */
+#define AUDIO_PKT_TX_QUANTUM 512
+#define AUDIO_PKT_TX_DEFAULT_WEIGHT 8
+
+/* Age after which a token the DSP never answered is expired */
+static unsigned int audio_pkt_token_timeout_ms = 30000;
+module_param_named(token_timeout_ms, audio_pkt_token_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(token_timeout_ms, "Expire unanswered GPR tokens after this many ms");
+
+/* Internal commands the driver keeps in flight at once */
+static unsigned int audio_pkt_cmd_window = 8;
+module_param_named(cmd_window, audio_pkt_cmd_window, uint, 0444);
+MODULE_PARM_DESC(cmd_window, "Maximum number of outstanding internal APM commands");
+
+/* Default receive wakeup coalescing of newly opened files */
+static unsigned int audio_pkt_coalesce_pkts = 1;
+module_param_named(coalesce_pkts, audio_pkt_coalesce_pkts, uint, 0644);
+MODULE_PARM_DESC(coalesce_pkts, "Wake readers after this many packets");
+
+static unsigned int audio_pkt_coalesce_usecs;
+module_param_named(coalesce_usecs, audio_pkt_coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(coalesce_usecs, "Wake readers at most this many us after a packet");
+
+/* Default receive queue limits of newly opened files */
+static unsigned int audio_pkt_rx_max_pkts = 512;
+module_param_named(rx_max_pkts, audio_pkt_rx_max_pkts, uint, 0644);
+MODULE_PARM_DESC(rx_max_pkts, "Receive queue limit in packets, 0 for none");
+
+static unsigned int audio_pkt_rx_max_bytes = SZ_1M;
+module_param_named(rx_max_bytes, audio_pkt_rx_max_bytes, uint, 0644);
+MODULE_PARM_DESC(rx_max_bytes, "Receive queue limit in bytes, 0 for none");
+
+/**
+ * enum audio_pkt_dsp_state - link state of the DSP of a device
+ * @AUDIO_PKT_DSP_OFFLINE:	the DSP crashed, every send fails
+ * @AUDIO_PKT_DSP_RECOVERING:	the DSP is back, only the driver sends,
+ *				to restore the memory maps of the clients
+ * @AUDIO_PKT_DSP_ONLINE:	the DSP is up
+ */
+enum audio_pkt_dsp_state {
+	AUDIO_PKT_DSP_OFFLINE,
+	AUDIO_PKT_DSP_RECOVERING,
+	AUDIO_PKT_DSP_ONLINE,
+};
+
+/*
+ * Data path commands and events (buffer submission and buffer done) have
+ * hard deadlines and are served ahead of control commands and responses.
+ */
+enum audio_pkt_lane {
+	AUDIO_PKT_LANE_HIGH,
+	AUDIO_PKT_LANE_LOW,
+	AUDIO_PKT_NUM_LANES,
+};
+
+/**
+ * struct audio_pkt_tx_queue - transmit queue of a client, or of the kernel
+ * @lanes:	requests waiting to be sent, by priority lane
+ * @node:	entry in the device list of active queues of @sched_class,
+ *		while any lane holds a request
+ * @weight:	share of the control command bandwidth within the class
+ * @sched_class:	AUDIO_PKT_TX_CLASS_RT or AUDIO_PKT_TX_CLASS_NORMAL
+ * @deficit:	bytes the queue may still send in the current round
+ */
+struct audio_pkt_tx_queue {
+	struct list_head lanes[AUDIO_PKT_NUM_LANES];
+	struct list_head node;
+	unsigned int weight;
+	unsigned int sched_class;
+	int deficit;
+};
 
 struct q6apm_audio_pkt {
         struct device *dev;
 	gpr_port_t *port;
         gpr_device_t *adev;
-        /* For Graph OPEN/START/STOP/CLOSE operations */
-        //wait_queue_head_t wait;
-        struct gpr_ibasic_rsp_result_t result;
-
-        struct mutex cmd_lock;
-        uint32_t state;
-
+	/* Bounds the internal commands in flight */
+	struct semaphore cmd_window;
 
 	struct cdev cdev;
-	struct mutex lock;
-	spinlock_t queue_lock;
-	struct sk_buff_head queue;
-	wait_queue_head_t readq;
 	char dev_name[20];
 	char ch_name[20];
-	dev_t audio_pkt_major;
-	struct class *audio_pkt_class;
+	/* GPR domain of the DSP, also the minor of the device */
+	u32 domain_id;
+
+	/* Outstanding commands by kernel token, looked up under RCU */
+	struct xarray audpkt_tokens;
+	u32 audpkt_next_token;
+	struct delayed_work token_reaper;
+	atomic_t tokens_expired;
+
+	/* Open files, receiving the packets nobody asked for */
+	spinlock_t clients_lock;
+	struct list_head clients;
+
+	/* Releases the DSP resources of closed files, restores them after a restart */
+	struct workqueue_struct *wq;
+	struct work_struct recover;
+	/* Written under tx_lock, as it decides which queued packets may go out */
+	enum audio_pkt_dsp_state dsp_state;
+	/* Number of times the DSP restarted since the device was created */
+	u32 restarts;
+	/* Last APM_CMD_GET_SPF_STATE answer, whoever asked; false while offline */
+	bool spf_ready;
+	/* AUDIO_PKT_DSP_STATE_* last published and the number of changes */
+	spinlock_t state_lock;
+	u32 user_state;
+	u32 state_seq;
+	wait_queue_head_t state_wait;
+	struct work_struct state_uevent;
+	/* Active transmit queues, drained to GPR by one sender at a time */
+	spinlock_t tx_lock;
+	struct list_head tx_active[AUDIO_PKT_TX_NUM_CLASSES];
+	/* Commands the driver issues itself, internal and stream buffers */
+	struct audio_pkt_tx_queue kernel_txq;
+	bool tx_draining;
+	/* Woken when the drain is released, remove waits for it before adev goes */
+	wait_queue_head_t tx_idle;
+	/* Set while GPR refuses packets, cleared by the first accepted one */
+	bool tx_congested;
+	struct delayed_work tx_retry;
+	wait_queue_head_t tx_wait;
+	atomic64_t tx_congestions;
+
+	/* In-kernel streams by id, looked up under RCU */
+	struct xarray streams;
+};
+
+/**
+ * struct audio_pkt_client - state of one open file of the audio pkt device
+ * @audpkt_dev:	device the file belongs to
+ * @refcount:	held by the file and by every token entry of the client
+ * @queue_lock:	synchronization of @queue and @uring_recvq
+ * @queue:	packets routed to this client, one queue per priority lane
+ * @readq:	wait object for @queue
+ * @uring_recvq:	io_uring receive commands waiting for the next packet
+ * @filter:	opcode and port subscription for packets without a token
+ *		entry, NULL to receive all of them
+ * @coalesce:	receive wakeup coalescing settings
+ * @coalesce_pending:	packets queued since the last wakeup of @readq
+ * @coalesce_timer:	wakes @readq once @coalesce max_usecs elapsed
+ * @busy_poll_usecs:	time a blocking read spins on @queue before sleeping
+ * @busy_poll_spins:	number of reads that spun
+ * @busy_poll_hits:	number of spins that found a packet
+ * @rx_limit:	bounds of @queue and what to drop beyond them
+ * @rx_bytes:	number of bytes in @queue
+ * @rx_dropped_pkts:	packets dropped because @queue was full
+ * @rx_dropped_bytes:	bytes dropped because @queue was full
+ * @template_lock:	synchronization of @templates
+ * @templates:	packets uploaded by the client for replay, by handle
+ * @txq:	packets the client is sending
+ * @owned_graphs:	sub graphs the client opened, by id
+ * @maps_lock:	serializes the release and the restore of @owned_maps
+ * @owned_maps:	DSP memory maps the client created, by the handle the
+ *		client was given
+ * @pending_maps:	memory map commands waiting for their handle, by token
+ * @pending_tracks:	graph opens and releases of graphs and maps waiting
+ *			for the DSP to accept them, by token
+ * @teardown:	releases the owned resources once the file is closed
+ * @dsp_state_seq:	device state change the file last read, POLLPRI is
+ *			raised until it catches up
+ * @node:	entry in the device client list
+ */
+struct audio_pkt_client {
+	struct q6apm_audio_pkt *audpkt_dev;
+	struct kref refcount;
+	spinlock_t queue_lock;
+	struct sk_buff_head queue[AUDIO_PKT_NUM_LANES];
+	wait_queue_head_t readq;
+	struct list_head uring_recvq;
+	struct audio_pkt_filter __rcu *filter;
+	struct audio_pkt_coalesce coalesce;
+	unsigned int coalesce_pending;
+	struct hrtimer coalesce_timer;
+	unsigned int busy_poll_usecs;
+	atomic64_t busy_poll_spins;
+	atomic64_t busy_poll_hits;
+	struct audio_pkt_rx_limit rx_limit;
+	unsigned int rx_bytes;
+	u64 rx_dropped_pkts;
+	u64 rx_dropped_bytes;
+	struct mutex template_lock;
+	struct xarray templates;
+	struct audio_pkt_tx_queue txq;
+	struct xarray owned_graphs;
+	struct mutex maps_lock;
+	struct xarray owned_maps;
+	struct xarray pending_maps;
+	struct xarray pending_tracks;
+	struct work_struct teardown;
+	u32 dsp_state_seq;
+	struct list_head node;
+};
 
-	struct mutex audpkt_port_lock;
-	struct idr audpkt_port_idr;
+/**
+ * struct audio_pkt_template_buf - packet held for replay by a client
+ * @len:	length of @data
+ * @data:	the GPR packet as uploaded
+ */
+struct audio_pkt_template_buf {
+	size_t len;
+	u8 data[];
 };
 
 struct audio_pkt_apm_cmd_shared_mem_map_regions_t {
@@ -96,16 +312,71 @@ struct audio_pkt_apm_shared_map_region_payload_t {
 	uint32_t mem_size_bytes;
 };
 
-struct audio_pkt_apm_mem_map {
-	struct audio_pkt_apm_cmd_shared_mem_map_regions_t mmap_header;
-	struct audio_pkt_apm_shared_map_region_payload_t mmap_payload;
+struct audio_pkt_apm_cmd_shared_mem_unmap_regions_t {
+	uint32_t mem_map_handle;
+};
+
+/**
+ * struct audio_pkt_mem_map - DSP memory map created by a client
+ * @dsp_handle:	handle the DSP knows the map by; the client is given its
+ *		own handle, so the DSP may reuse this one after a restart
+ * @rcu:	for lockless handle translation
+ * @num_bufs:	number of entries in @bufs
+ * @bufs:	reference to the msm_audio registry buffer of each region,
+ *		NULL for a region given by address; dropped when the map
+ *		is freed, stored after @cmd
+ * @len:	length of @cmd
+ * @cmd:	APM_CMD_SHARED_MEM_MAP_REGIONS packet as the client sent it,
+ *		replayed when the DSP restarts
+ */
+struct audio_pkt_mem_map {
+	u32 dsp_handle;
+	struct rcu_head rcu;
+	unsigned int num_bufs;
+	void **bufs;
+	size_t len;
+	u8 cmd[];
+};
+
+/**
+ * struct audio_pkt_track - ownership change a client asked the DSP for
+ * @opcode:	APM_CMD_GRAPH_OPEN, APM_CMD_GRAPH_CLOSE, APM_CMD_CLOSE_ALL
+ *		or APM_CMD_SHARED_MEM_UNMAP_REGIONS
+ * @num:	number of entries in @ids
+ * @ids:	sub graphs opened or closed, or the handle of the map released
+ */
+struct audio_pkt_track {
+	u32 opcode;
+	u32 num;
+	u32 ids[];
 };
 
-struct audio_gpr_pkt {
-	struct gpr_hdr audpkt_hdr;
-	struct audio_pkt_apm_mem_map audpkt_mem_map;
+/**
+ * struct audio_pkt_addr_desc - shared memory references carried by a command
+ * @opcode:	GPR opcode of the command
+ * @addr_offset:	payload offset of the lsw, msw address pair of the
+ *		first reference
+ * @len_offset:	offset of the length of a reference from its address
+ * @count_offset:	payload offset of the 16 bit number of references,
+ *		AUDIO_PKT_ADDR_SINGLE for a single one
+ * @stride:	distance between two references
+ * @lsw_is_fd:	tells whether the lsw of each reference holds a bare fd,
+ *		the legacy encoding of offset mode memory maps
+ */
+struct audio_pkt_addr_desc {
+	u32 opcode;
+	u16 addr_offset;
+	u16 len_offset;
+	u16 count_offset;
+	u16 stride;
+	bool (*lsw_is_fd)(const void *payload);
 };
 
+#define AUDIO_PKT_ADDR_SINGLE	U16_MAX
+
+/* APM commands share this opcode range; all but a few start with an apm_cmd_header */
+#define AUDIO_PKT_APM_CMD_MASK	0xFFFFF000
+
 typedef void (*audio_pkt_clnt_cb_fn)(void *buf, int len, void *priv);
 
 struct audio_pkt_clnt_ch {
@@ -113,75 +384,152 @@ struct audio_pkt_clnt_ch {
 	audio_pkt_clnt_cb_fn func;
 };
 
-struct gpr_port_map {
-	u32 src_port;
-	u32 dst_port;
+/**
+ * struct audio_pkt_uring_req - io_uring command waiting for a DSP packet
+ * @ioucmd:	io_uring command to complete
+ * @ubuf:	user buffer receiving the packet
+ * @len:	size of @ubuf
+ * @token:	kernel token of the packet sent by an AUDIO_PKT_URING_CMD_SEND
+ * @is_send:	true for AUDIO_PKT_URING_CMD_SEND, false for a receive
+ * @skb:	packet to copy out on completion
+ * @status:	error to complete with when there is no @skb
+ * @node:	entry in the uring_recvq list
+ */
+struct audio_pkt_uring_req {
+	struct io_uring_cmd *ioucmd;
+	void __user *ubuf;
+	size_t len;
+	u32 token;
+	bool is_send;
+	struct sk_buff *skb;
+	int status;
+	struct list_head node;
 };
 
-#define dev_to_audpkt_dev(_dev) container_of(_dev, struct q6apm_audio_pkt, dev)
-#define cdev_to_audpkt_dev(_cdev) container_of(_cdev, struct q6apm_audio_pkt, cdev)
-
-static struct q6apm_audio_pkt *g_apm;
-
-static int q6apm_send_audio_cmd_sync(struct device *dev, gpr_device_t *gdev,
-			     struct gpr_ibasic_rsp_result_t *result, struct mutex *cmd_lock,
-			     gpr_port_t *port, wait_queue_head_t *cmd_wait,
-			     struct gpr_pkt *pkt, uint32_t rsp_opcode)
-{
-
-	struct gpr_hdr *hdr = &pkt->hdr;
-	int rc, wait_time = 2;
-
-	mutex_lock(cmd_lock);
-	result->opcode = 0;
-	result->status = 0;
+/**
+ * struct audio_pkt_tx_req - framed GPR packets queued on a transmit lane
+ * @node:	entry in the transmit lane
+ * @txq:	transmit queue holding the request
+ * @buf:	the framed packets
+ * @count:	number of bytes in @buf
+ * @sent:	number of bytes handed to GPR so far
+ * @ret:	transport error that stopped the request
+ * @done:	completed once every packet is sent or one failed
+ */
+struct audio_pkt_tx_req {
+	struct list_head node;
+	struct audio_pkt_tx_queue *txq;
+	void *buf;
+	size_t count;
+	size_t sent;
+	int ret;
+	/* a packet of the request is with GPR, tx_lock is not held */
+	bool sending;
+	/* the sender was killed, stop after the packet being sent */
+	bool withdrawn;
+	struct completion done;
+};
 
-	if (hdr->opcode == APM_CMD_CLOSE_ALL)
-		wait_time = 20;
+struct audio_pkt_uring_pdu {
+	struct audio_pkt_uring_req *ureq;
+};
 
-	if (port)
-		rc = gpr_send_port_pkt(port, pkt);
-	else if (gdev)
-		rc = gpr_send_pkt(gdev, pkt);
-	else
-		rc = -EINVAL;
+/**
+ * struct audio_pkt_txn - thread waiting in AUDIO_PKT_IOCTL_SEND_WAIT
+ * @done:	completed by the GPR callback when the response arrives
+ * @skb:	the response packet
+ * @status:	error to return when there is no @skb
+ */
+struct audio_pkt_txn {
+	struct completion done;
+	struct sk_buff *skb;
+	int status;
+};
 
-	if (rc < 0)
-		goto err;
+/**
+ * struct audio_pkt_stream - ring of shared memory buffers fed by the kernel
+ * @refcount:	held by the stream table and by each user of the stream
+ * @audpkt_dev:	device the stream sends through
+ * @client:	file that started the stream
+ * @id:		index in the device stream table
+ * @cfg:	ring layout and endpoint given by userspace
+ * @ctrl_buf:	dma-buf holding the control block
+ * @ctrl_map:	kernel mapping of @ctrl_buf
+ * @ctrl:	control block shared with userspace
+ * @event:	signalled whenever the control block tail moves
+ * @lock:	serializes submissions
+ * @ring_lock:	protects @submitted, @returned and @stopped, taken by the
+ *		GPR callback as buffers come back
+ * @submitted:	buffers handed to the DSP, free running
+ * @returned:	buffers given back by the DSP, free running
+ * @stopped:	no more buffers are submitted
+ * @refill:	submits the buffers a return made room for, the GPR
+ *		callback must not wait for the transmit path
+ * @rcu:	deferred free of the stream
+ */
+struct audio_pkt_stream {
+	struct kref refcount;
+	struct q6apm_audio_pkt *audpkt_dev;
+	struct audio_pkt_client *client;
+	u32 id;
+	struct audio_pkt_stream_cfg cfg;
+	struct dma_buf *ctrl_buf;
+	struct iosys_map ctrl_map;
+	struct audio_pkt_stream_ctrl *ctrl;
+	struct eventfd_ctx *event;
+	struct mutex lock;
+	spinlock_t ring_lock;
+	u32 submitted;
+	u32 returned;
+	bool stopped;
+	struct work_struct refill;
+	struct rcu_head rcu;
+};
 
-	if (rsp_opcode)
-		rc = wait_event_timeout(*cmd_wait, (result->opcode == hdr->opcode) ||
-					(result->opcode == rsp_opcode),	wait_time * HZ);
-	else
-		rc = wait_event_timeout(*cmd_wait, (result->opcode == hdr->opcode), wait_time * HZ);
-
-	if (!rc) {
-		dev_err(dev, "CMD timeout for [%x] opcode\n", hdr->opcode);
-		rc = -ETIMEDOUT;
-	} else if (result->status > 0) {
-		dev_err(dev, "DSP returned error[%x] %x\n", hdr->opcode, result->status);
-		rc = -EINVAL;
-	} else {
-		/* DSP successfully finished the command */
-		rc = 0;
-	}
+struct gpr_port_map {
+	u32 src_port;
+	u32 dst_port;
+	/* token chosen by the client, restored on the response */
+	u32 user_token;
+	u32 opcode;
+	/* jiffies when the command was sent, for the stale entry reaper */
+	unsigned long stamp;
+	/* the token comes back more than once, see audio_pkt_take_route() */
+	bool persistent;
+	/* a persistent entry got its first answer, it no longer expires */
+	bool answered;
+	struct rcu_head rcu;
+	/* client whose queue receives the response, holds a reference */
+	struct audio_pkt_client *client;
+	/* set when the response completes an io_uring command */
+	struct audio_pkt_uring_req *ureq;
+	/* set when a thread waits for the response */
+	struct audio_pkt_txn *txn;
+};
 
-err:
-	mutex_unlock(cmd_lock);
-	return rc;
-}
+#define dev_to_audpkt_dev(_dev) container_of(_dev, struct q6apm_audio_pkt, dev)
+#define cdev_to_audpkt_dev(_cdev) container_of(_cdev, struct q6apm_audio_pkt, cdev)
 
+static dev_t audio_pkt_devt;
+static struct class *audio_pkt_class;
+/* Audio pkt device of each DSP domain, indexed by GPR domain id */
+static struct q6apm_audio_pkt *audio_pkt_domains[AUDIO_PKT_MAX_DOMAINS];
+/* Woken whenever the cached APM readiness of a domain changes */
+static DECLARE_WAIT_QUEUE_HEAD(audio_pkt_ready_wait);
 
-static int q6apm_audio_send_cmd(struct q6apm_audio_pkt *apm, struct gpr_pkt *pkt, uint32_t rsp_opcode)
-{
-	gpr_device_t *gdev = apm->adev;
+static const char *const audio_pkt_domain_names[AUDIO_PKT_MAX_DOMAINS] = {
+	[GPR_DOMAIN_ID_MODEM] = "modem",
+	[GPR_DOMAIN_ID_ADSP] = "adsp",
+};
 
-	return q6apm_send_audio_cmd_sync(&gdev->dev, gdev, &apm->result, &apm->lock,
-					NULL, &apm->readq, pkt, rsp_opcode);
-}
+static void audio_pkt_client_stop_streams(struct audio_pkt_client *client);
+static void audio_pkt_client_free_templates(struct audio_pkt_client *client);
+static void audio_pkt_client_teardown(struct work_struct *work);
+static void audio_pkt_recover(struct work_struct *work);
 
-static void *__q6apm_audio_alloc_pkt(int payload_size, uint32_t opcode, uint32_t token,
-				    uint32_t src_port, uint32_t dest_port, bool has_cmd_hdr)
+static void *__q6apm_audio_alloc_pkt(struct q6apm_audio_pkt *apm, int payload_size,
+				     uint32_t opcode, uint32_t token, uint32_t src_port,
+				     uint32_t dest_port, bool has_cmd_hdr)
 {
 	struct gpr_pkt *pkt;
 	void *p;
@@ -201,7 +549,7 @@ static void *__q6apm_audio_alloc_pkt(int payload_size, uint32_t opcode, uint32_t
 	pkt->hdr.dest_port = dest_port;
 	pkt->hdr.src_port = src_port;
 
-	pkt->hdr.dest_domain = GPR_DOMAIN_ID_ADSP;
+	pkt->hdr.dest_domain = apm->domain_id;
 	pkt->hdr.src_domain = GPR_DOMAIN_ID_APPS;
 	pkt->hdr.token = token;
 	pkt->hdr.opcode = opcode;
@@ -217,61 +565,191 @@ static void *__q6apm_audio_alloc_pkt(int payload_size, uint32_t opcode, uint32_t
 	return pkt;
 }
 
-static void *q6apm_audio_alloc_apm_cmd_pkt(int pkt_size, uint32_t opcode, uint32_t token)
+static void *q6apm_audio_alloc_apm_cmd_pkt(struct q6apm_audio_pkt *apm, int pkt_size,
+					   uint32_t opcode, uint32_t token)
 {
-	return __q6apm_audio_alloc_pkt(pkt_size, opcode, token, GPR_APM_MODULE_IID,
+	return __q6apm_audio_alloc_pkt(apm, pkt_size, opcode, token, GPR_APM_MODULE_IID,
 				       APM_MODULE_INSTANCE_ID, true);
 }
 
-static int q6apm_audio_get_apm_state(struct q6apm_audio_pkt *apm)
+static void audio_pkt_client_free(struct kref *ref)
 {
-	struct gpr_pkt *pkt;
+	struct audio_pkt_client *client = container_of(ref, struct audio_pkt_client,
+						       refcount);
+	int lane;
+
+	hrtimer_cancel(&client->coalesce_timer);
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		skb_queue_purge(&client->queue[lane]);
+	kfree(rcu_dereference_protected(client->filter, true));
+	kfree(client);
+}
 
-	pkt = q6apm_audio_alloc_apm_cmd_pkt(0, APM_CMD_GET_SPF_STATE, 0);
-	if (IS_ERR(pkt))
-		return PTR_ERR(pkt);
+static void audio_pkt_client_put(struct audio_pkt_client *client)
+{
+	/* Internal commands have no client */
+	if (client)
+		kref_put(&client->refcount, audio_pkt_client_free);
+}
 
-	q6apm_audio_send_cmd(apm, pkt, APM_CMD_RSP_GET_SPF_STATE);
+/* Next packet for @client, high priority lane first. Needs queue_lock. */
+static struct sk_buff *__audio_pkt_client_dequeue(struct audio_pkt_client *client)
+{
+	struct sk_buff *skb = NULL;
+	int lane;
 
-	kfree(pkt);
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES && !skb; lane++)
+		skb = __skb_dequeue(&client->queue[lane]);
 
-	return apm->state;
+	if (skb)
+		client->rx_bytes -= skb->len;
+
+	return skb;
 }
 
-bool q6apm_audio_is_adsp_ready(void)
+static unsigned int audio_pkt_client_qlen(struct audio_pkt_client *client)
 {
-	if (g_apm)
-		return q6apm_audio_get_apm_state(g_apm);
+	unsigned int qlen = 0;
+	int lane;
 
-	return false;
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		qlen += skb_queue_len(&client->queue[lane]);
+
+	return qlen;
 }
 
-static void q6apm_audio_close_all(void)
+/*
+ * Make room for @skb in the receive queue of @client, dropping the oldest
+ * packets, low priority lane first, when the policy allows it. Packets
+ * dropped are moved to @dropped. Called with queue_lock held.
+ */
+static bool __audio_pkt_client_admit(struct audio_pkt_client *client,
+				     struct sk_buff *skb,
+				     struct sk_buff_head *dropped)
 {
-	struct gpr_pkt *pkt;
+	struct audio_pkt_rx_limit *limit = &client->rx_limit;
+	struct sk_buff *old;
+	int lane;
+
+	while (audio_pkt_client_qlen(client) >= limit->max_pkts ||
+	       (u64)client->rx_bytes + skb->len > limit->max_bytes) {
+		if (limit->policy != AUDIO_PKT_RX_DROP_OLDEST ||
+		    !audio_pkt_client_qlen(client))
+			return false;
+
+		old = NULL;
+		for (lane = AUDIO_PKT_NUM_LANES - 1; lane >= 0 && !old; lane--)
+			old = __skb_dequeue(&client->queue[lane]);
+
+		client->rx_bytes -= old->len;
+		client->rx_dropped_pkts++;
+		client->rx_dropped_bytes += old->len;
+		__skb_queue_tail(dropped, old);
+	}
 
-	pkt = q6apm_audio_alloc_apm_cmd_pkt(0, APM_CMD_CLOSE_ALL, 0);
-	if (IS_ERR(pkt))
-		return;
+	return true;
+}
 
-	q6apm_audio_send_cmd(g_apm, pkt, GPR_BASIC_RSP_RESULT);
+static bool audio_pkt_client_empty(struct audio_pkt_client *client)
+{
+	int lane;
 
-	kfree(pkt);
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		if (!skb_queue_empty_lockless(&client->queue[lane]))
+			return false;
+
+	return true;
+}
+
+static enum hrtimer_restart audio_pkt_coalesce_timeout(struct hrtimer *timer)
+{
+	struct audio_pkt_client *client = container_of(timer, struct audio_pkt_client,
+						       coalesce_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	client->coalesce_pending = 0;
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	wake_up_interruptible(&client->readq);
+
+	return HRTIMER_NORESTART;
 }
 
 static int audio_pkt_open(struct inode *inode, struct file *file)
 {
 	struct q6apm_audio_pkt *audpkt_dev = cdev_to_audpkt_dev(inode->i_cdev);
 	struct device *dev = audpkt_dev->dev;
+	struct audio_pkt_client *client;
+	unsigned long flags;
+	int lane;
 
 	AUDIO_PKT_ERR("for %s\n", audpkt_dev->ch_name);
 
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->audpkt_dev = audpkt_dev;
+	kref_init(&client->refcount);
+	spin_lock_init(&client->queue_lock);
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		skb_queue_head_init(&client->queue[lane]);
+	init_waitqueue_head(&client->readq);
+	INIT_LIST_HEAD(&client->uring_recvq);
+	client->dsp_state_seq = READ_ONCE(audpkt_dev->state_seq);
+	mutex_init(&client->template_lock);
+	xa_init_flags(&client->templates, XA_FLAGS_ALLOC1);
+	audio_pkt_txq_init(&client->txq, AUDIO_PKT_TX_CLASS_NORMAL);
+	xa_init(&client->owned_graphs);
+	mutex_init(&client->maps_lock);
+	xa_init_flags(&client->owned_maps, XA_FLAGS_ALLOC1);
+	xa_init(&client->pending_maps);
+	xa_init(&client->pending_tracks);
+	INIT_WORK(&client->teardown, audio_pkt_client_teardown);
+	hrtimer_setup(&client->coalesce_timer, audio_pkt_coalesce_timeout,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	client->coalesce.max_pkts = max(READ_ONCE(audio_pkt_coalesce_pkts), 1U);
+	client->coalesce.max_usecs = READ_ONCE(audio_pkt_coalesce_usecs);
+	/* Without a timeout, a batch could sit in the queue forever */
+	if (!client->coalesce.max_usecs)
+		client->coalesce.max_pkts = 1;
+	client->rx_limit.max_pkts = READ_ONCE(audio_pkt_rx_max_pkts) ?: UINT_MAX;
+	client->rx_limit.max_bytes = READ_ONCE(audio_pkt_rx_max_bytes) ?: UINT_MAX;
+	client->rx_limit.policy = AUDIO_PKT_RX_DROP_NEWEST;
+
+	spin_lock_irqsave(&audpkt_dev->clients_lock, flags);
+	list_add_tail(&client->node, &audpkt_dev->clients);
+	spin_unlock_irqrestore(&audpkt_dev->clients_lock, flags);
+
 	get_device(dev);
-	file->private_data = audpkt_dev;
+	file->private_data = client;
 
 	return 0;
 }
 
+/* Drop the token entries still waiting for a response to @client */
+static void audio_pkt_client_unmap_tokens(struct audio_pkt_client *client)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct gpr_port_map *audpkt_port_map;
+	unsigned long id;
+
+	rcu_read_lock();
+	xa_for_each(&audpkt_dev->audpkt_tokens, id, audpkt_port_map) {
+		if (audpkt_port_map->client != client)
+			continue;
+
+		if (xa_cmpxchg(&audpkt_dev->audpkt_tokens, id, audpkt_port_map,
+			       NULL, 0) != audpkt_port_map)
+			continue;
+
+		audio_pkt_client_put(client);
+		kfree_rcu(audpkt_port_map, rcu);
+	}
+	rcu_read_unlock();
+}
+
 /**
  * audio_pkt_release() - release operation on audio_pkt device
  * inode:	Pointer to the inode structure.
@@ -284,28 +762,64 @@ static int audio_pkt_open(struct inode *inode, struct file *file)
 static int audio_pkt_release(struct inode *inode, struct file *file)
 {
 	struct q6apm_audio_pkt *audpkt_dev = cdev_to_audpkt_dev(inode->i_cdev);
+	struct audio_pkt_client *client = file->private_data;
 	struct device *dev = audpkt_dev->dev;
-	struct sk_buff *skb;
 	unsigned long flags;
+	int lane;
+
+	spin_lock_irqsave(&audpkt_dev->clients_lock, flags);
+	list_del(&client->node);
+	spin_unlock_irqrestore(&audpkt_dev->clients_lock, flags);
 
-	spin_lock_irqsave(&audpkt_dev->queue_lock, flags);
+	audio_pkt_client_stop_streams(client);
+	audio_pkt_client_unmap_tokens(client);
+	audio_pkt_client_free_templates(client);
 
 	/* Discard all SKBs */
-	while (!skb_queue_empty(&audpkt_dev->queue)) {
-		skb = skb_dequeue(&audpkt_dev->queue);
-		kfree_skb(skb);
-	}
-	wake_up_interruptible(&audpkt_dev->readq);
-	spin_unlock_irqrestore(&audpkt_dev->queue_lock, flags);
+	spin_lock_irqsave(&client->queue_lock, flags);
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		__skb_queue_purge(&client->queue[lane]);
+	client->rx_bytes = 0;
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	/*
+	 * Closing graphs and unmapping memory takes DSP round trips; the
+	 * teardown work does it and drops the file reference to @client.
+	 */
+	queue_work(audpkt_dev->wq, &client->teardown);
 
 	put_device(dev);
 	file->private_data = NULL;
-	q6apm_audio_close_all();
-	msm_audio_mem_crash_handler();
 
 	return 0;
 }
 
+/*
+ * Spin on the receive queue of @client for its busy poll budget, saving a
+ * sleep and wakeup when the DSP answers quickly. Returns true when a
+ * packet arrived.
+ */
+static bool audio_pkt_busy_poll(struct audio_pkt_client *client)
+{
+	unsigned int usecs = READ_ONCE(client->busy_poll_usecs);
+	u64 end;
+
+	if (!usecs)
+		return false;
+
+	atomic64_inc(&client->busy_poll_spins);
+	end = local_clock() + (u64)usecs * NSEC_PER_USEC;
+	do {
+		if (!audio_pkt_client_empty(client)) {
+			atomic64_inc(&client->busy_poll_hits);
+			return true;
+		}
+		cpu_relax();
+	} while (local_clock() < end && !need_resched() && !signal_pending(current));
+
+	return false;
+}
+
 /**
  * audio_pkt_read() - read() syscall for the audio_pkt device
  * file:	Pointer to the file structure.
@@ -320,350 +834,3672 @@ static int audio_pkt_release(struct inode *inode, struct file *file)
 static ssize_t audio_pkt_read(struct file *file, char __user *buf,
 		       size_t count, loff_t *ppos)
 {
-	struct q6apm_audio_pkt *audpkt_dev = file->private_data;
+	struct audio_pkt_client *client = file->private_data;
+	bool polled = false;
 	unsigned long flags;
 	struct sk_buff *skb;
 	int use;
-	uint32_t *temp;
 
-	if (!audpkt_dev) {
+	if (!client) {
 		AUDIO_PKT_ERR("invalid device handle\n");
 		return -EINVAL;
 	}
 
-	spin_lock_irqsave(&audpkt_dev->queue_lock, flags);
-	/* Wait for data in the queue */
-	if (skb_queue_empty(&audpkt_dev->queue)) {
-		spin_unlock_irqrestore(&audpkt_dev->queue_lock, flags);
+	for (;;) {
+		spin_lock_irqsave(&client->queue_lock, flags);
+		skb = __audio_pkt_client_dequeue(client);
+		spin_unlock_irqrestore(&client->queue_lock, flags);
+		if (skb)
+			break;
 
 		if (file->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 
-		/* Wait until we get data or the endpoint goes away */
-		if (wait_event_interruptible(audpkt_dev->readq,
-					!skb_queue_empty(&audpkt_dev->queue)))
-			return -ERESTARTSYS;
+		if (!polled) {
+			polled = true;
+			if (audio_pkt_busy_poll(client))
+				continue;
+		}
 
-		spin_lock_irqsave(&audpkt_dev->queue_lock, flags);
+		/*
+		 * Wait until we get data or the endpoint goes away. Readers
+		 * wait exclusively, so a packet wakes a single one of them.
+		 */
+		if (wait_event_interruptible_exclusive(client->readq,
+					!audio_pkt_client_empty(client)))
+			return -ERESTARTSYS;
 	}
 
-	skb = skb_dequeue(&audpkt_dev->queue);
-	spin_unlock_irqrestore(&audpkt_dev->queue_lock, flags);
-	if (!skb)
-		return -EFAULT;
+	/* Pass the wakeup on to the next reader while packets remain */
+	if (!audio_pkt_client_empty(client))
+		wake_up_interruptible(&client->readq);
 
 	use = min_t(size_t, count, skb->len);
 	if (copy_to_user(buf, skb->data, use))
 		use = -EFAULT;
-	temp = (uint32_t *) skb->data;
 	kfree_skb(skb);
 
 	return use;
 }
 
-/**
- * audpkt_update_physical_addr - Update physical address
- * audpkt_hdr:	Pointer to the file structure.
- */
-static int audpkt_chk_and_update_physical_addr(struct audio_gpr_pkt *gpr_pkt)
+/* Memory maps in offset mode give a bare fd in the lsw of each region */
+static bool audio_pkt_mem_map_lsw_is_fd(const void *payload)
 {
-	size_t pa_len = 0;
-	dma_addr_t paddr = 0;
-	int ret = 0;
+	const struct audio_pkt_apm_cmd_shared_mem_map_regions_t *mmap_header = payload;
 
-	if (gpr_pkt->audpkt_mem_map.mmap_header.property_flag &
-				APM_MEMORY_MAP_BIT_MASK_IS_OFFSET_MODE) {
+	return mmap_header->property_flag & APM_MEMORY_MAP_BIT_MASK_IS_OFFSET_MODE;
+}
 
-		/* TODO: move physical address mapping to use DMA-BUF heaps */
-		ret = msm_audio_get_phy_addr(
-				(int) gpr_pkt->audpkt_mem_map.mmap_payload.shm_addr_lsw,
-				&paddr, &pa_len);
-		if (ret < 0) {
-			AUDIO_PKT_ERR("%s Get phy. address failed, ret %d\n",
-					__func__, ret);
-			return ret;
-		}
+static const struct audio_pkt_addr_desc audio_pkt_addr_descs[] = {
+	{
+		.opcode = APM_CMD_SHARED_MEM_MAP_REGIONS,
+		.addr_offset = sizeof(struct audio_pkt_apm_cmd_shared_mem_map_regions_t),
+		.len_offset = offsetof(struct audio_pkt_apm_shared_map_region_payload_t,
+				       mem_size_bytes),
+		.count_offset = offsetof(struct audio_pkt_apm_cmd_shared_mem_map_regions_t,
+					 num_regions),
+		.stride = sizeof(struct audio_pkt_apm_shared_map_region_payload_t),
+		.lsw_is_fd = audio_pkt_mem_map_lsw_is_fd,
+	}, {
+		.opcode = APM_CMD_GRAPH_OPEN,
+		.addr_offset = offsetof(struct apm_cmd_header, payload_address_lsw),
+		.len_offset = offsetof(struct apm_cmd_header, payload_size),
+		.count_offset = AUDIO_PKT_ADDR_SINGLE,
+	}, {
+		.opcode = APM_CMD_SET_CFG,
+		.addr_offset = offsetof(struct apm_cmd_header, payload_address_lsw),
+		.len_offset = offsetof(struct apm_cmd_header, payload_size),
+		.count_offset = AUDIO_PKT_ADDR_SINGLE,
+	}, {
+		.opcode = APM_CMD_GET_CFG,
+		.addr_offset = offsetof(struct apm_cmd_header, payload_address_lsw),
+		.len_offset = offsetof(struct apm_cmd_header, payload_size),
+		.count_offset = AUDIO_PKT_ADDR_SINGLE,
+	}, {
+		.opcode = DATA_CMD_WR_SH_MEM_EP_DATA_BUFFER_V2,
+		.addr_offset = offsetof(struct apm_data_cmd_wr_sh_mem_ep_data_buffer_v2,
+					buf_addr_lsw),
+		.len_offset = offsetof(struct apm_data_cmd_wr_sh_mem_ep_data_buffer_v2,
+				       buf_size),
+		.count_offset = AUDIO_PKT_ADDR_SINGLE,
+	}, {
+		.opcode = DATA_CMD_RD_SH_MEM_EP_DATA_BUFFER_V2,
+		.addr_offset = offsetof(struct data_cmd_rd_sh_mem_ep_data_buffer_v2,
+					buf_addr_lsw),
+		.len_offset = offsetof(struct data_cmd_rd_sh_mem_ep_data_buffer_v2,
+				       buf_size),
+		.count_offset = AUDIO_PKT_ADDR_SINGLE,
+	},
+};
 
-		AUDIO_PKT_INFO("%s physical address %pK", __func__,
-				(void *) paddr);
-		gpr_pkt->audpkt_mem_map.mmap_payload.shm_addr_lsw = (uint32_t) paddr;
-		gpr_pkt->audpkt_mem_map.mmap_payload.shm_addr_msw = (uint64_t) paddr >> 32;
-	}
-	return ret;
+/* Drop the buffers of @map and free it */
+static void audio_pkt_mem_map_free(struct audio_pkt_mem_map *map)
+{
+	unsigned int i;
+
+	if (!map)
+		return;
+
+	for (i = 0; i < map->num_bufs; i++)
+		if (map->bufs[i])
+			msm_audio_mem_put_buf(map->bufs[i]);
+	kfree(map);
 }
 
-/**
- * audio_pkt_write() - write() syscall for the audio_pkt device
- * file:	Pointer to the file structure.
- * buf:		Pointer to the userspace buffer.
- * count:	Number bytes to read from the file.
- * ppos:	Pointer to the position into the file.
- *
- * This function is used to write the data to audio pkt device when
- * userspace client do a write() system call. All input arguments are
- * validated by the virtual file system before calling this function.
+/* Free a map once lockless readers of owned_maps are done with it */
+static void audio_pkt_mem_map_free_rcu(struct rcu_head *rcu)
+{
+	audio_pkt_mem_map_free(container_of(rcu, struct audio_pkt_mem_map, rcu));
+}
+
+/*
+ * Handle the DSP knows the memory map @handle of @client by. Handle 0
+ * names no map and is kept; any other handle must be one of @client.
  */
-static ssize_t audio_pkt_write(struct file *file, const char __user *buf,
-			size_t count, loff_t *ppos)
+static int audio_pkt_client_dsp_handle(struct audio_pkt_client *client, u32 handle,
+				       u32 *dsp_handle)
 {
-	struct q6apm_audio_pkt *audpkt_dev = file->private_data;
-	struct gpr_hdr *audpkt_hdr = NULL;
-	void *kbuf;
-	int ret;
-	struct gpr_port_map *audpkt_port_map;
+	struct audio_pkt_mem_map *map;
 
-	if (!audpkt_dev)  {
-		AUDIO_PKT_ERR("invalid device handle\n");
-		return -EINVAL;
+	if (!handle) {
+		*dsp_handle = 0;
+		return 0;
 	}
 
-	kbuf = memdup_user(buf, count);
-	if (IS_ERR(kbuf))
-		return PTR_ERR(kbuf);
+	rcu_read_lock();
+	map = xa_load(&client->owned_maps, handle);
+	if (map)
+		*dsp_handle = READ_ONCE(map->dsp_handle);
+	rcu_read_unlock();
 
-	audpkt_hdr = (struct gpr_hdr *) kbuf;
-	if (audpkt_hdr->opcode == APM_CMD_SHARED_MEM_MAP_REGIONS) {
-		ret = audpkt_chk_and_update_physical_addr((struct audio_gpr_pkt *) audpkt_hdr);
-		if (ret < 0) {
-			AUDIO_PKT_ERR("Update Physical Address Failed -%d\n", ret);
-			return ret;
+	return map ? 0 : -EINVAL;
+}
+
+/* Handle @client was given for the map the DSP knows as @dsp_handle */
+static bool audio_pkt_client_user_handle(struct audio_pkt_client *client, u32 dsp_handle,
+					 u32 *handle)
+{
+	struct audio_pkt_mem_map *map;
+	unsigned long id;
+	bool found = false;
+
+	rcu_read_lock();
+	xa_for_each(&client->owned_maps, id, map) {
+		if (READ_ONCE(map->dsp_handle) == dsp_handle) {
+			*handle = id;
+			found = true;
+			break;
 		}
 	}
+	rcu_read_unlock();
 
-	audpkt_port_map = kmalloc(sizeof(*audpkt_port_map), GFP_KERNEL);
-	if (!audpkt_port_map) {
-		AUDIO_PKT_ERR("kmalloc FAILED !!\n");
-		goto free_kbuf;
+	return found;
+}
+
+/* Payload offset of the memory map handle a command carries, or -1 */
+static int audio_pkt_cmd_handle_offset(u32 opcode)
+{
+	switch (opcode) {
+	case DATA_CMD_WR_SH_MEM_EP_DATA_BUFFER_V2:
+		return offsetof(struct apm_data_cmd_wr_sh_mem_ep_data_buffer_v2,
+				mem_map_handle);
+	case DATA_CMD_RD_SH_MEM_EP_DATA_BUFFER_V2:
+		return offsetof(struct data_cmd_rd_sh_mem_ep_data_buffer_v2,
+				mem_map_handle);
+	case APM_CMD_SHARED_MEM_UNMAP_REGIONS:
+		return offsetof(struct audio_pkt_apm_cmd_shared_mem_unmap_regions_t,
+				mem_map_handle);
+	case APM_CMD_SHARED_MEM_MAP_REGIONS:
+	case APM_CMD_CLOSE_ALL:
+	case APM_CMD_GET_SPF_STATE:
+		return -1;
 	}
 
-	audpkt_port_map->src_port = audpkt_hdr->src_port;
-	audpkt_port_map->dst_port = audpkt_hdr->dest_port;
+	if ((opcode & AUDIO_PKT_APM_CMD_MASK) == (APM_CMD_GRAPH_OPEN & AUDIO_PKT_APM_CMD_MASK))
+		return offsetof(struct apm_cmd_header, mem_map_handle);
 
-	mutex_lock(&audpkt_dev->audpkt_port_lock);
-	ret = idr_alloc(&audpkt_dev->audpkt_port_idr, audpkt_port_map,
-			audpkt_hdr->token,
-			audpkt_hdr->token + 1,
-			GFP_KERNEL);
-	mutex_unlock(&audpkt_dev->audpkt_port_lock);
+	return -1;
+}
 
-	if (ret < 0) {
-		kfree(audpkt_port_map);
-		AUDIO_PKT_ERR("idr_alloc failed for token=%u\n", audpkt_hdr->token);
-		goto free_kbuf;
+/*
+ * Translate the memory map handle of a client command to the one the DSP
+ * knows, so handles stay valid across DSP restarts and one client cannot
+ * name the maps of another.
+ */
+static int audio_pkt_translate_handle(struct audio_pkt_client *client,
+				      struct gpr_hdr *audpkt_hdr)
+{
+	u32 hdr_size = audpkt_hdr->hdr_size * 4;
+	size_t payload_size = audpkt_hdr->pkt_size - hdr_size;
+	void *payload = (void *)audpkt_hdr + hdr_size;
+	int off = audio_pkt_cmd_handle_offset(audpkt_hdr->opcode);
+	u32 *handle;
+
+	if (off < 0 || off + sizeof(u32) > payload_size)
+		return 0;
+
+	handle = payload + off;
+	return audio_pkt_client_dsp_handle(client, *handle, handle);
+}
+
+/*
+ * Resolve one reference given as AUDIO_PKT_ADDR_FD_TAG | fd in the msw
+ * and an offset in the lsw, or as a bare fd in the lsw when @lsw_is_fd,
+ * to a DSP address. References already holding an address are left
+ * untouched. A reference to the buffer the reference resolved to is
+ * returned in @bufp. The msm_audio buffers are assigned to the ADSP
+ * alone, other DSPs get -EOPNOTSUPP.
+ */
+static int audio_pkt_patch_addr(u32 *addr, u32 len, bool lsw_is_fd, bool adsp,
+				void **bufp)
+{
+	dma_addr_t paddr = 0;
+	size_t pa_len = 0;
+	u32 offset;
+	void *buf;
+	int fd;
+
+	*bufp = NULL;
+	if (lsw_is_fd) {
+		fd = addr[0];
+		offset = 0;
+	} else if ((addr[1] & ~AUDIO_PKT_ADDR_FD_MASK) == AUDIO_PKT_ADDR_FD_TAG) {
+		fd = addr[1] & AUDIO_PKT_ADDR_FD_MASK;
+		offset = addr[0];
 	} else {
-		audpkt_hdr->src_port = GPR_APM_MODULE_IID;
+		return 0;
 	}
 
-	if (mutex_lock_interruptible(&audpkt_dev->lock)) {
-		ret = -ERESTARTSYS;
-		goto free_kbuf;
+	if (!adsp) {
+		AUDIO_PKT_ERR("fd %d referenced on a DSP other than the ADSP\n", fd);
+		return -EOPNOTSUPP;
 	}
-	ret = gpr_send_pkt(audpkt_dev->adev, (struct gpr_pkt *) kbuf);
-	if (ret < 0) {
-		AUDIO_PKT_ERR("APR Send Packet Failed ret -%d\n", ret);
-		return ret;
+
+	/* The registry is global, the fd must name its buffer in this process */
+	buf = msm_audio_mem_get_buf(fd, &paddr, &pa_len);
+	if (IS_ERR(buf)) {
+		AUDIO_PKT_ERR("no mapping for fd %d, ret %ld\n", fd, PTR_ERR(buf));
+		return PTR_ERR(buf);
 	}
-	mutex_unlock(&audpkt_dev->lock);
 
-free_kbuf:
-	kfree(kbuf);
-	return ret < 0 ? ret : count;
+	if (offset > pa_len || len > pa_len - offset) {
+		AUDIO_PKT_ERR("%u bytes at %u overflow fd %d\n", len, offset, fd);
+		msm_audio_mem_put_buf(buf);
+		return -EINVAL;
+	}
+
+	paddr += offset;
+	AUDIO_PKT_INFO("%s physical address %pK", __func__, (void *) paddr);
+	addr[0] = lower_32_bits(paddr);
+	addr[1] = upper_32_bits(paddr);
+	*bufp = buf;
+
+	return 0;
 }
 
 /**
- * audio_pkt_poll() - poll() syscall for the audio_pkt device
- * file:	Pointer to the file structure.
- * wait:	pointer to Poll table.
+ * audio_pkt_patch_addrs() - Resolve the fd references of a command
+ * audpkt_dev:	Device of the DSP the packet goes to.
+ * client:	Client sending the packet, NULL for internal commands.
+ * audpkt_hdr:	Validated GPR packet.
+ * map:		Memory map the packet creates, NULL if none.
  *
- * This function is used to poll on the audio pkt device when
- * userspace client do a poll() system call. All input arguments are
- * validated by the virtual file system before calling this function.
+ * Every shared memory reference audio_pkt_addr_descs lists for the opcode
+ * of the packet is patched in one pass. The buffers a memory map refers
+ * to are held by @map, for as long as the map exists. Internal commands
+ * carry addresses only.
  */
-static unsigned int audio_pkt_poll(struct file *file, poll_table *wait)
+static int audio_pkt_patch_addrs(struct q6apm_audio_pkt *audpkt_dev,
+				 struct audio_pkt_client *client,
+				 struct gpr_hdr *audpkt_hdr,
+				 struct audio_pkt_mem_map *map)
 {
-	struct q6apm_audio_pkt *audpkt_dev = file->private_data;
-	unsigned int mask = 0;
-	unsigned long flags;
-
-	audpkt_dev = file->private_data;
-	if (!audpkt_dev) {
-		AUDIO_PKT_ERR("invalid device handle\n");
-		return POLLERR;
-	}
-
-	poll_wait(file, &audpkt_dev->readq, wait);
+	u32 hdr_size = audpkt_hdr->hdr_size * 4;
+	size_t payload_size = audpkt_hdr->pkt_size - hdr_size;
+	void *payload = (void *)audpkt_hdr + hdr_size;
+	const struct audio_pkt_addr_desc *desc;
+	u16 count, i;
+	size_t off;
+	void *buf;
+	int ret;
 
-	mutex_lock(&audpkt_dev->lock);
+	if (!client)
+		return 0;
 
-	spin_lock_irqsave(&audpkt_dev->queue_lock, flags);
-	if (!skb_queue_empty(&audpkt_dev->queue))
-		mask |= POLLIN | POLLRDNORM;
+	for (desc = audio_pkt_addr_descs;
+	     desc < audio_pkt_addr_descs + ARRAY_SIZE(audio_pkt_addr_descs); desc++) {
+		if (desc->opcode != audpkt_hdr->opcode)
+			continue;
 
-	spin_unlock_irqrestore(&audpkt_dev->queue_lock, flags);
+		if (desc->count_offset == AUDIO_PKT_ADDR_SINGLE) {
+			count = 1;
+		} else {
+			if (desc->count_offset + sizeof(u16) > payload_size)
+				return -EINVAL;
+			count = *(u16 *)(payload + desc->count_offset);
+		}
 
-	mutex_unlock(&audpkt_dev->lock);
+		for (i = 0; i < count; i++) {
+			off = desc->addr_offset + (size_t)i * desc->stride;
+			if (off + 2 * sizeof(u32) > payload_size ||
+			    off + desc->len_offset + sizeof(u32) > payload_size)
+				return -EINVAL;
+
+			ret = audio_pkt_patch_addr(payload + off,
+					*(u32 *)(payload + off + desc->len_offset),
+					desc->lsw_is_fd && desc->lsw_is_fd(payload),
+					audpkt_dev->domain_id == GPR_DOMAIN_ID_ADSP, &buf);
+			if (ret < 0)
+				return ret;
+
+			/* Kept per region, to rebuild the map after a restart */
+			if (map) {
+				map->bufs[i] = buf;
+				map->num_bufs = i + 1;
+			} else if (buf) {
+				msm_audio_mem_put_buf(buf);
+			}
+		}
+	}
 
-	return mask;
+	return 0;
 }
 
+/*
+ * Collect into @ids, or just count when @ids is NULL, the sub graphs the
+ * APM_CMD_GRAPH_OPEN parameters @params open. The sub graph config lists
+ * each sub graph with a variable number of properties; parameter blocks
+ * are 8 byte aligned.
+ */
+static u32 audio_pkt_graph_open_ids(const void *params, size_t end, u32 *ids)
+{
+	const struct apm_module_param_data *param;
+	const struct apm_sub_graph_cfg *sg;
+	const struct apm_prop_data *prop;
+	size_t off = 0, param_end;
+	u32 num, i, j, found = 0;
+
+	while (end - off >= sizeof(*param)) {
+		param = params + off;
+		if (param->param_size > end - off - sizeof(*param))
+			break;
+		param_end = off + sizeof(*param) + param->param_size;
+
+		if (param->param_id == APM_PARAM_ID_SUB_GRAPH_CONFIG &&
+		    param->param_size >= sizeof(num)) {
+			off += sizeof(*param);
+			num = *(u32 *)(params + off);
+			off += sizeof(num);
+			for (i = 0; i < num && param_end - off >= sizeof(*sg); i++) {
+				sg = params + off;
+				if (ids)
+					ids[found] = sg->sub_graph_id;
+				found++;
+				off += sizeof(*sg);
+				for (j = 0; j < sg->num_sub_graph_prop &&
+				     param_end - off >= sizeof(*prop); j++) {
+					prop = params + off;
+					if (prop->prop_size > param_end - off - sizeof(*prop))
+						break;
+					off += sizeof(*prop) + prop->prop_size;
+				}
+			}
+		}
 
-static const struct file_operations audio_pkt_fops = {
-	.owner = THIS_MODULE,
-	.open = audio_pkt_open,
-	.release = audio_pkt_release,
-	.read = audio_pkt_read,
-	.write = audio_pkt_write,
-	.poll = audio_pkt_poll,
-};
+		off = ALIGN(param_end, 8);
+		if (off > end)
+			break;
+	}
 
-static int q6apm_audio_pkt_probe(gpr_device_t *adev)
+	return found;
+}
+
+/*
+ * Copy @size bytes of the out-of-band payload @client placed at @addr in
+ * its memory map @handle. Addresses are offsets into the regions of an
+ * offset mode map, physical addresses otherwise. Only regions backed by
+ * msm_audio buffers can be read.
+ */
+static void *audio_pkt_client_read_oob(struct audio_pkt_client *client, u32 handle,
+				       u64 addr, u32 size)
 {
-	struct device *dev = &adev->dev;
-	struct q6apm_audio_pkt *apm;
+	const struct audio_pkt_apm_shared_map_region_payload_t *region;
+	const struct gpr_hdr *hdr;
+	struct audio_pkt_mem_map *map;
+	const void *payload;
+	void *buf = NULL, *data;
+	dma_addr_t paddr;
+	size_t pa_len;
+	u64 offset = 0;
+	bool offset_mode;
+	unsigned int i;
 	int ret;
 
-	apm = devm_kzalloc(dev, sizeof(*apm), GFP_KERNEL);
-	if (!apm)
-		return -ENOMEM;
+	rcu_read_lock();
+	map = xa_load(&client->owned_maps, handle);
+	if (map) {
+		hdr = (const struct gpr_hdr *)map->cmd;
+		payload = map->cmd + hdr->hdr_size * 4;
+		offset_mode = audio_pkt_mem_map_lsw_is_fd(payload);
+		region = payload + sizeof(struct audio_pkt_apm_cmd_shared_mem_map_regions_t);
+		for (i = 0; i < map->num_bufs; i++, region++) {
+			if (offset_mode) {
+				if (addr >= region->mem_size_bytes) {
+					addr -= region->mem_size_bytes;
+					continue;
+				}
+				offset = addr;
+			} else {
+				if (!map->bufs[i])
+					continue;
+				msm_audio_mem_buf_addr(map->bufs[i], &paddr, &pa_len);
+				paddr += region->shm_addr_lsw;
+				if (addr < paddr || addr - paddr >= region->mem_size_bytes)
+					continue;
+				offset = addr - paddr;
+			}
+
+			if (map->bufs[i] && size <= region->mem_size_bytes - offset) {
+				buf = map->bufs[i];
+				if (!offset_mode)
+					offset += region->shm_addr_lsw;
+				msm_audio_mem_hold_buf(buf);
+			}
+			break;
+		}
+	}
+	rcu_read_unlock();
 
+	if (!buf)
+		return ERR_PTR(-EINVAL);
 
-	ret = alloc_chrdev_region(&apm->audio_pkt_major, 0,
-				  MINOR_NUMBER_COUNT, AUDPKT_DRIVER_NAME);
-	if (ret < 0) {
-		pr_err("alloc_chrdev_region failed ret:%d\n", ret);
-		goto err_chrdev;
+	data = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+	if (!data) {
+		msm_audio_mem_put_buf(buf);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	apm->audio_pkt_class = class_create(AUDPKT_DRIVER_NAME);
-	if (IS_ERR(apm->audio_pkt_class)) {
-		ret = PTR_ERR(apm->audio_pkt_class);
-		pr_err("class_create failed ret:%ld\n",
-			      PTR_ERR(apm->audio_pkt_class));
-		goto err_class;
+	ret = msm_audio_mem_read_buf(buf, offset, data, size);
+	msm_audio_mem_put_buf(buf);
+	if (ret < 0) {
+		kvfree(data);
+		return ERR_PTR(ret);
 	}
 
-	apm->dev = device_create(apm->audio_pkt_class, NULL,
-					apm->audio_pkt_major, NULL,
-					AUDPKT_DRIVER_NAME);
-	if (IS_ERR(apm->dev)) {
-		ret = PTR_ERR(apm->dev);
-		pr_err("device_create failed ret:%ld\n",
-			      PTR_ERR(apm->dev));
-		goto err_device;
-	}
+	return data;
+}
+
+/*
+ * Build the record of the sub graphs an APM_CMD_GRAPH_OPEN opens. An
+ * out-of-band config is read from the memory map it lives in: the file
+ * closes the graphs it owns on release, none may go unrecorded.
+ */
+static struct audio_pkt_track *audio_pkt_track_graph_open(struct audio_pkt_client *client,
+							  const void *payload, size_t size)
+{
+	const struct apm_cmd_header *cmd_hdr = payload;
+	struct audio_pkt_track *track;
+	const void *params;
+	void *oob = NULL;
+	size_t end;
+	u32 num;
+
+	if (size < sizeof(*cmd_hdr))
+		return ERR_PTR(-EINVAL);
+
+	if (cmd_hdr->mem_map_handle) {
+		oob = audio_pkt_client_read_oob(client, cmd_hdr->mem_map_handle,
+						(u64)cmd_hdr->payload_address_msw << 32 |
+						cmd_hdr->payload_address_lsw,
+						cmd_hdr->payload_size);
+		if (IS_ERR(oob)) {
+			AUDIO_PKT_ERR("graph config unreadable in map %u\n",
+				      cmd_hdr->mem_map_handle);
+			return ERR_CAST(oob);
+		}
+		params = oob;
+		end = cmd_hdr->payload_size;
+	} else {
+		params = payload + sizeof(*cmd_hdr);
+		end = min_t(size_t, cmd_hdr->payload_size, size - sizeof(*cmd_hdr));
+	}
+
+	num = audio_pkt_graph_open_ids(params, end, NULL);
+	track = kmalloc(struct_size(track, ids, num), GFP_KERNEL);
+	if (track) {
+		track->num = audio_pkt_graph_open_ids(params, end, track->ids);
+		track->opcode = APM_CMD_GRAPH_OPEN;
+	} else {
+		track = ERR_PTR(-ENOMEM);
+	}
+
+	kvfree(oob);
+	return track;
+}
+
+/*
+ * Keep track of the graphs and memory maps @client creates and destroys
+ * itself, so closing the file releases exactly what is left of them.
+ * Memory map handles are learnt from the response, see the GPR callback.
+ * Opens and releases only take effect once the DSP accepted them, so the
+ * returned track, if any, waits for the response in pending_tracks.
+ */
+static struct audio_pkt_track *audio_pkt_client_track(struct audio_pkt_client *client,
+						       struct gpr_hdr *audpkt_hdr)
+{
+	u32 hdr_size = audpkt_hdr->hdr_size * 4;
+	size_t payload_size = audpkt_hdr->pkt_size - hdr_size;
+	void *payload = (void *)audpkt_hdr + hdr_size;
+	struct audio_pkt_apm_cmd_shared_mem_unmap_regions_t *unmap;
+	const struct apm_graph_mgmt_cmd *mgmt_cmd;
+	struct audio_pkt_track *track;
+	u32 num;
+
+	switch (audpkt_hdr->opcode) {
+	case APM_CMD_GRAPH_OPEN:
+		return audio_pkt_track_graph_open(client, payload, payload_size);
+	case APM_CMD_GRAPH_CLOSE:
+		if (payload_size < APM_CMD_HDR_SIZE + sizeof(*mgmt_cmd))
+			return NULL;
+		mgmt_cmd = payload + APM_CMD_HDR_SIZE;
+		for (num = 0; num < mgmt_cmd->num_sub_graphs &&
+		     APM_GRAPH_MGMT_PSIZE(mgmt_cmd, num + 1) <= payload_size - APM_CMD_HDR_SIZE;
+		     num++)
+			;
+		track = kmalloc(struct_size(track, ids, num), GFP_KERNEL);
+		if (!track)
+			return ERR_PTR(-ENOMEM);
+		memcpy(track->ids, mgmt_cmd->sub_graph_id_list, num * sizeof(u32));
+		break;
+	case APM_CMD_CLOSE_ALL:
+		num = 0;
+		track = kmalloc(sizeof(*track), GFP_KERNEL);
+		if (!track)
+			return ERR_PTR(-ENOMEM);
+		break;
+	case APM_CMD_SHARED_MEM_UNMAP_REGIONS:
+		if (payload_size < sizeof(*unmap))
+			return NULL;
+		unmap = payload;
+		num = 1;
+		track = kmalloc(struct_size(track, ids, num), GFP_KERNEL);
+		if (!track)
+			return ERR_PTR(-ENOMEM);
+		track->ids[0] = unmap->mem_map_handle;
+		break;
+	default:
+		return NULL;
+	}
+
+	track->opcode = audpkt_hdr->opcode;
+	track->num = num;
+	return track;
+}
+
+/* Apply the change waiting for the response to @token, if it succeeded */
+static void audio_pkt_client_commit_track(struct audio_pkt_client *client, u32 token,
+					  const struct gpr_resp_pkt *data)
+{
+	const struct gpr_ibasic_rsp_result_t *result = data->payload;
+	struct audio_pkt_track *track;
+	struct audio_pkt_mem_map *map;
+	u32 i;
+
+	track = xa_erase(&client->pending_tracks, token);
+	if (!track)
+		return;
+
+	if (data->hdr.opcode != GPR_BASIC_RSP_RESULT ||
+	    data->payload_size < sizeof(*result) || result->status)
+		goto free_track;
+
+	switch (track->opcode) {
+	case APM_CMD_GRAPH_OPEN:
+		for (i = 0; i < track->num; i++)
+			xa_store(&client->owned_graphs, track->ids[i],
+				 xa_mk_value(0), GFP_ATOMIC);
+		break;
+	case APM_CMD_GRAPH_CLOSE:
+		for (i = 0; i < track->num; i++)
+			xa_erase(&client->owned_graphs, track->ids[i]);
+		break;
+	case APM_CMD_CLOSE_ALL:
+		xa_destroy(&client->owned_graphs);
+		break;
+	case APM_CMD_SHARED_MEM_UNMAP_REGIONS:
+		map = xa_erase(&client->owned_maps, track->ids[0]);
+		if (map)
+			call_rcu(&map->rcu, audio_pkt_mem_map_free_rcu);
+		break;
+	}
+
+free_track:
+	kfree(track);
+}
+
+/* Forget what @client meant to track with a command that got no response */
+static void audio_pkt_client_drop_pending(struct audio_pkt_client *client, u32 token)
+{
+	if (!client)
+		return;
+
+	audio_pkt_mem_map_free(xa_erase(&client->pending_maps, token));
+	kfree(xa_erase(&client->pending_tracks, token));
+}
+
+static void audio_pkt_unmap_token(struct q6apm_audio_pkt *audpkt_dev, uint32_t token)
+{
+	struct gpr_port_map *audpkt_port_map;
+
+	audpkt_port_map = xa_erase(&audpkt_dev->audpkt_tokens, token);
+	if (audpkt_port_map) {
+		audio_pkt_client_drop_pending(audpkt_port_map->client, token);
+		audio_pkt_client_put(audpkt_port_map->client);
+		kfree_rcu(audpkt_port_map, rcu);
+	}
+}
+
+/*
+ * Take back the token entry of a waiter that gave up. Returns false if the
+ * response already removed it, in which case the waiter is still completed.
+ */
+static bool audio_pkt_claim_token(struct q6apm_audio_pkt *audpkt_dev, uint32_t token,
+				  const struct gpr_port_map *route)
+{
+	struct gpr_port_map *audpkt_port_map;
+	bool claimed = false;
+
+	rcu_read_lock();
+	audpkt_port_map = xa_load(&audpkt_dev->audpkt_tokens, token);
+	if (audpkt_port_map && audpkt_port_map->ureq == route->ureq &&
+	    audpkt_port_map->txn == route->txn &&
+	    xa_cmpxchg(&audpkt_dev->audpkt_tokens, token, audpkt_port_map,
+		       NULL, 0) == audpkt_port_map) {
+		audio_pkt_client_drop_pending(audpkt_port_map->client, token);
+		audio_pkt_client_put(audpkt_port_map->client);
+		kfree_rcu(audpkt_port_map, rcu);
+		claimed = true;
+	}
+	rcu_read_unlock();
+
+	return claimed;
+}
+
+/*
+ * Commands whose token comes back more than once: the events a module
+ * registration subscribes to carry it, and an EOS is acknowledged first
+ * and reported rendered later.
+ */
+static bool audio_pkt_token_persists(u32 opcode)
+{
+	return opcode == APM_CMD_REGISTER_MODULE_EVENTS ||
+	       opcode == DATA_CMD_WR_SH_MEM_EP_EOS;
+}
+
+/**
+ * audio_pkt_prepare_pkt() - Prepare a userspace GPR packet for the DSP
+ * audpkt_dev:	Pointer to the audio pkt device.
+ * audpkt_hdr:	Pointer to the GPR packet in kernel memory.
+ * route:	Client and optional waiter receiving the response.
+ *
+ * Patches shared memory addresses and allocates a kernel token that maps
+ * back to the client, its own token and ports, so the response can be
+ * routed and restored. The token and source port in the packet are
+ * rewritten to the kernel token and the APM service. Clients may thus
+ * use overlapping token schemes and any number of outstanding commands.
+ * The destination domain is the DSP of the device the packet was sent on.
+ */
+static int audio_pkt_prepare_pkt(struct q6apm_audio_pkt *audpkt_dev,
+				 struct gpr_hdr *audpkt_hdr,
+				 const struct gpr_port_map *route)
+{
+	struct audio_pkt_track *track = NULL;
+	struct audio_pkt_mem_map *map = NULL;
+	struct gpr_port_map *audpkt_port_map;
+	size_t map_size, max_bufs;
+	void *old;
+	u32 token;
+	int ret;
+
+	/* Kept as sent, fd references included, to be replayed after a restart */
+	if (route->client && audpkt_hdr->opcode == APM_CMD_SHARED_MEM_MAP_REGIONS) {
+		map_size = ALIGN(struct_size(map, cmd, audpkt_hdr->pkt_size), sizeof(void *));
+		max_bufs = audpkt_hdr->pkt_size /
+			   sizeof(struct audio_pkt_apm_shared_map_region_payload_t);
+		map = kmalloc(map_size + max_bufs * sizeof(void *), GFP_KERNEL);
+		if (!map)
+			return -ENOMEM;
+		map->num_bufs = 0;
+		map->bufs = (void *)map + map_size;
+		map->len = audpkt_hdr->pkt_size;
+		memcpy(map->cmd, audpkt_hdr, map->len);
+	}
+
+	ret = audio_pkt_patch_addrs(audpkt_dev, route->client, audpkt_hdr, map);
+	if (ret < 0) {
+		AUDIO_PKT_ERR("Update Physical Address Failed -%d\n", ret);
+		goto free_map;
+	}
+
+	if (route->client) {
+		track = audio_pkt_client_track(route->client, audpkt_hdr);
+		if (IS_ERR(track)) {
+			ret = PTR_ERR(track);
+			track = NULL;
+			goto free_map;
+		}
+
+		ret = audio_pkt_translate_handle(route->client, audpkt_hdr);
+		if (ret < 0) {
+			AUDIO_PKT_ERR("unknown memory map handle in opcode 0x%x\n",
+				      audpkt_hdr->opcode);
+			goto free_map;
+		}
+	}
+
+	audpkt_port_map = kzalloc(sizeof(*audpkt_port_map), GFP_KERNEL);
+	if (!audpkt_port_map) {
+		ret = -ENOMEM;
+		goto free_map;
+	}
+
+	*audpkt_port_map = *route;
+	audpkt_port_map->src_port = audpkt_hdr->src_port;
+	audpkt_port_map->dst_port = audpkt_hdr->dest_port;
+	audpkt_port_map->user_token = audpkt_hdr->token;
+	audpkt_port_map->opcode = audpkt_hdr->opcode;
+	audpkt_port_map->stamp = jiffies;
+	audpkt_port_map->persistent = route->client &&
+				      audio_pkt_token_persists(audpkt_hdr->opcode);
+	if (route->client)
+		kref_get(&route->client->refcount);
+
+	/* Token 0 is left to the commands the driver sends itself */
+	ret = xa_alloc_cyclic(&audpkt_dev->audpkt_tokens, &token, audpkt_port_map,
+			      XA_LIMIT(1, INT_MAX), &audpkt_dev->audpkt_next_token,
+			      GFP_KERNEL);
+	if (ret < 0) {
+		audio_pkt_client_put(route->client);
+		kfree(audpkt_port_map);
+		AUDIO_PKT_ERR("token allocation failed for token=%u\n", audpkt_hdr->token);
+		goto free_map;
+	}
+
+	/* The GPR callback moves it to owned_maps along with its handle */
+	if (map) {
+		old = xa_store(&route->client->pending_maps, token, map, GFP_KERNEL);
+		if (xa_is_err(old))
+			audio_pkt_mem_map_free(map);
+		else
+			audio_pkt_mem_map_free(old);
+	}
+
+	/* Applied by the GPR callback once the DSP accepted it */
+	if (track) {
+		old = xa_store(&route->client->pending_tracks, token, track,
+			       GFP_KERNEL);
+		if (xa_is_err(old))
+			kfree(track);
+		else
+			kfree(old);
+	}
+
+	if (!delayed_work_pending(&audpkt_dev->token_reaper))
+		schedule_delayed_work(&audpkt_dev->token_reaper,
+				      msecs_to_jiffies(AUDIO_PKT_TOKEN_REAP_INTERVAL_MS));
+
+	audpkt_hdr->token = token;
+	audpkt_hdr->src_port = GPR_APM_MODULE_IID;
+	audpkt_hdr->src_domain = GPR_DOMAIN_ID_APPS;
+	audpkt_hdr->dest_domain = audpkt_dev->domain_id;
+	return 0;
+
+free_map:
+	kfree(track);
+	audio_pkt_mem_map_free(map);
+	return ret;
+}
+
+/**
+ * audio_pkt_frame_len() - Length of the GPR packet frame at @buf
+ * buf:		Pointer to the start of the frame.
+ * avail:	Number of bytes left in the write buffer.
+ *
+ * Frames are packed back to back, each padded to a 4 byte boundary.
+ * The padding of the last frame may be omitted.
+ *
+ * Return: number of bytes to advance to the next frame, or -EINVAL if
+ * the frame header is truncated or inconsistent.
+ */
+static ssize_t audio_pkt_frame_len(const void *buf, size_t avail)
+{
+	const struct gpr_hdr *hdr = buf;
+	size_t pkt_size;
+
+	if (avail < GPR_HDR_SIZE)
+		return -EINVAL;
+
+	pkt_size = hdr->pkt_size;
+	if (pkt_size < GPR_HDR_SIZE || pkt_size < hdr->hdr_size * 4 ||
+	    pkt_size > avail || pkt_size > AUDIO_PKT_MAX_PKT_SIZE)
+		return -EINVAL;
+
+	return min_t(size_t, ALIGN(pkt_size, 4), avail);
+}
+
+static enum audio_pkt_lane audio_pkt_tx_lane(void *buf, size_t count)
+{
+	struct gpr_hdr *audpkt_hdr;
+	size_t off;
+
+	/* Only a batch made of data commands alone may skip the queue */
+	for (off = 0; off < count; off += audio_pkt_frame_len(audpkt_hdr, count - off)) {
+		audpkt_hdr = buf + off;
+		if (GPR_OPCODE_CLASS(audpkt_hdr->opcode) != GPR_OPCODE_CLASS_DATA_CMD)
+			return AUDIO_PKT_LANE_LOW;
+	}
+
+	return AUDIO_PKT_LANE_HIGH;
+}
+
+static void audio_pkt_txq_init(struct audio_pkt_tx_queue *txq, unsigned int sched_class)
+{
+	int lane;
+
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		INIT_LIST_HEAD(&txq->lanes[lane]);
+	INIT_LIST_HEAD(&txq->node);
+	txq->weight = AUDIO_PKT_TX_DEFAULT_WEIGHT;
+	txq->sched_class = sched_class;
+}
+
+static bool audio_pkt_txq_empty(struct audio_pkt_tx_queue *txq)
+{
+	int lane;
+
+	for (lane = 0; lane < AUDIO_PKT_NUM_LANES; lane++)
+		if (!list_empty(&txq->lanes[lane]))
+			return false;
+
+	return true;
+}
+
+/*
+ * Pick the request whose next packet goes out. Real-time queues are
+ * served before normal ones. Within a class, data commands of any queue
+ * go first, then control commands are shared between the queues by
+ * deficit round robin in proportion to their weights, so a bulk sender
+ * delays another queue by at most one quantum per round. Called with
+ * tx_lock held.
+ */
+static struct audio_pkt_tx_req *audio_pkt_tx_next(struct q6apm_audio_pkt *audpkt_dev)
+{
+	struct audio_pkt_tx_queue *txq;
+	struct audio_pkt_tx_req *req;
+	struct list_head *active;
+	int sched_class;
+
+	for (sched_class = 0; sched_class < AUDIO_PKT_TX_NUM_CLASSES; sched_class++) {
+		active = &audpkt_dev->tx_active[sched_class];
+		if (list_empty(active))
+			continue;
+
+		list_for_each_entry(txq, active, node) {
+			req = list_first_entry_or_null(&txq->lanes[AUDIO_PKT_LANE_HIGH],
+						       struct audio_pkt_tx_req, node);
+			if (req)
+				return req;
+		}
+
+		/* Every active queue of the class now has control commands */
+		for (;;) {
+			txq = list_first_entry(active, struct audio_pkt_tx_queue, node);
+			if (txq->deficit > 0)
+				return list_first_entry(&txq->lanes[AUDIO_PKT_LANE_LOW],
+							struct audio_pkt_tx_req, node);
+
+			txq->deficit += txq->weight * AUDIO_PKT_TX_QUANTUM;
+			list_rotate_left(active);
+		}
+	}
+
+	return NULL;
+}
+
+/* Retire @req from its queue and wake its sender. Called with tx_lock held. */
+static void audio_pkt_tx_req_done(struct audio_pkt_tx_req *req)
+{
+	list_del(&req->node);
+	if (audio_pkt_txq_empty(req->txq)) {
+		list_del_init(&req->txq->node);
+		req->txq->deficit = 0;
+	}
+	complete(&req->done);
+}
+
+/**
+ * audio_pkt_tx_drain() - Hand queued packets to GPR
+ * audpkt_dev:	Pointer to the audio pkt device.
+ * retry:	Called to retry after congestion.
+ *
+ * Only one sender drains at a time; it sends the packets of every queued
+ * request, one packet per iteration and always from the highest priority
+ * lane, so a data command queued behind a long batch of control commands
+ * goes out after at most one more control packet.
+ *
+ * When the transport is full the packet stays queued and the drain is
+ * retried later; senders keep waiting meanwhile.
+ */
+static void audio_pkt_tx_drain(struct q6apm_audio_pkt *audpkt_dev, bool retry)
+{
+	struct audio_pkt_tx_req *req;
+	struct gpr_hdr *audpkt_hdr;
+	gpr_device_t *adev;
+	bool writable;
+	unsigned long flags;
+	bool offline;
+	ssize_t len;
+	int ret;
+
+	spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+	if (audpkt_dev->tx_draining || (audpkt_dev->tx_congested && !retry)) {
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+		return;
+	}
+	audpkt_dev->tx_draining = true;
+
+	while ((req = audio_pkt_tx_next(audpkt_dev))) {
+		offline = audpkt_dev->dsp_state == AUDIO_PKT_DSP_OFFLINE;
+		adev = audpkt_dev->adev;
+		req->sending = true;
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+
+		audpkt_hdr = req->buf + req->sent;
+		len = audio_pkt_frame_len(audpkt_hdr, req->count - req->sent);
+		if (offline)
+			ret = -ENETRESET;
+		else
+			ret = gpr_send_pkt(adev, (struct gpr_pkt *) audpkt_hdr);
+
+		spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+		req->sending = false;
+		if (ret == -EAGAIN || ret == -EBUSY) {
+			if (!audpkt_dev->tx_congested)
+				atomic64_inc(&audpkt_dev->tx_congestions);
+			audpkt_dev->tx_congested = true;
+			schedule_delayed_work(&audpkt_dev->tx_retry,
+					      msecs_to_jiffies(AUDIO_PKT_TX_RETRY_MS));
+			if (req->withdrawn)
+				audio_pkt_tx_req_done(req);
+			break;
+		}
+
+		audpkt_dev->tx_congested = false;
+
+		if (ret < 0) {
+			if (!offline)
+				AUDIO_PKT_ERR("APR Send Packet Failed ret -%d\n", ret);
+			req->ret = ret;
+		} else {
+			req->sent += len;
+			req->txq->deficit -= len;
+		}
+
+		if (ret < 0 || req->sent == req->count || req->withdrawn)
+			audio_pkt_tx_req_done(req);
+	}
+
+	audpkt_dev->tx_draining = false;
+	writable = !audpkt_dev->tx_congested;
+	spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+	wake_up_all(&audpkt_dev->tx_idle);
+
+	/* Non-blocking writers found the path busy, not only congested */
+	if (writable)
+		wake_up_interruptible_poll(&audpkt_dev->tx_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+static void audio_pkt_tx_retry(struct work_struct *work)
+{
+	struct q6apm_audio_pkt *audpkt_dev = container_of(to_delayed_work(work),
+							  struct q6apm_audio_pkt,
+							  tx_retry);
+
+	audio_pkt_tx_drain(audpkt_dev, true);
+}
+
+/**
+ * audio_pkt_tx_send() - Send validated GPR packets through a transmit lane
+ * audpkt_dev:	Pointer to the audio pkt device.
+ * txq:		Transmit queue of the sender.
+ * buf:		Framed packets, already prepared for the DSP.
+ * count:	Number of bytes in @buf.
+ *
+ * A fatal signal withdraws what is left of the request; a packet already
+ * with GPR is waited for.
+ *
+ * Return: number of bytes sent, which is short of @count if the transport
+ * failed part way through or the sender was killed, or a negative error
+ * code if nothing was sent. -ENETRESET tells the DSP is restarting; while
+ * it recovers only the driver itself may send.
+ */
+static ssize_t audio_pkt_tx_send(struct q6apm_audio_pkt *audpkt_dev,
+				 struct audio_pkt_tx_queue *txq, void *buf, size_t count)
+{
+	struct audio_pkt_tx_req req = {
+		.txq = txq,
+		.buf = buf,
+		.count = count,
+	};
+	unsigned long flags;
+
+	init_completion(&req.done);
+
+	spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+	if (audpkt_dev->dsp_state == AUDIO_PKT_DSP_OFFLINE ||
+	    (audpkt_dev->dsp_state == AUDIO_PKT_DSP_RECOVERING &&
+	     txq != &audpkt_dev->kernel_txq)) {
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+		return -ENETRESET;
+	}
+	list_add_tail(&req.node, &txq->lanes[audio_pkt_tx_lane(buf, count)]);
+	if (list_empty(&txq->node))
+		list_add_tail(&txq->node, &audpkt_dev->tx_active[txq->sched_class]);
+	spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+
+	audio_pkt_tx_drain(audpkt_dev, false);
+	if (wait_for_completion_killable(&req.done)) {
+		/* Completed under tx_lock, so still queued unless done */
+		spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+		if (!completion_done(&req.done)) {
+			req.ret = -EINTR;
+			if (req.sending)
+				req.withdrawn = true;
+			else
+				audio_pkt_tx_req_done(&req);
+		}
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+		wait_for_completion(&req.done);
+	}
+
+	return req.sent ? req.sent : req.ret;
+}
+
+/**
+ * audio_pkt_tx_try_send() - Send GPR packets without sleeping
+ * audpkt_dev:	Pointer to the audio pkt device.
+ * txq:		Transmit queue of the sender.
+ * buf:		Framed packets, already prepared for the DSP.
+ * count:	Number of bytes in @buf.
+ *
+ * The packets go out from the calling context only when nothing else is
+ * queued or being sent, so they never overtake earlier packets. Sending
+ * stops at the first packet the transport has no room for.
+ *
+ * Return: number of bytes sent, -EAGAIN if the first packet would have to
+ * wait, or a negative error code.
+ */
+static ssize_t audio_pkt_tx_try_send(struct q6apm_audio_pkt *audpkt_dev,
+				     struct audio_pkt_tx_queue *txq, void *buf, size_t count)
+{
+	gpr_device_t *adev;
+	unsigned long flags;
+	int sched_class;
+	ssize_t len;
+	size_t sent;
+	int ret = 0;
+
+	spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+	if (audpkt_dev->dsp_state == AUDIO_PKT_DSP_OFFLINE ||
+	    (audpkt_dev->dsp_state == AUDIO_PKT_DSP_RECOVERING &&
+	     txq != &audpkt_dev->kernel_txq)) {
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+		return -ENETRESET;
+	}
+
+	for (sched_class = 0; sched_class < AUDIO_PKT_TX_NUM_CLASSES; sched_class++) {
+		if (!list_empty(&audpkt_dev->tx_active[sched_class]))
+			break;
+	}
+	if (audpkt_dev->tx_draining || audpkt_dev->tx_congested ||
+	    sched_class < AUDIO_PKT_TX_NUM_CLASSES) {
+		spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+		return -EAGAIN;
+	}
+	audpkt_dev->tx_draining = true;
+	adev = audpkt_dev->adev;
+	spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+
+	for (sent = 0; sent < count; sent += len) {
+		len = audio_pkt_frame_len(buf + sent, count - sent);
+		ret = gpr_send_pkt(adev, (struct gpr_pkt *)(buf + sent));
+		if (ret < 0)
+			break;
+	}
+
+	spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+	audpkt_dev->tx_draining = false;
+	spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+	wake_up_all(&audpkt_dev->tx_idle);
+
+	/* Senders that queued meanwhile found the drain taken */
+	audio_pkt_tx_drain(audpkt_dev, false);
+
+	if (sent)
+		return sent;
+
+	return ret == -EBUSY ? -EAGAIN : ret;
+}
+
+/**
+ * audio_pkt_send_frames() - Validate and send a batch of GPR packets
+ * client:	Client sending the packets.
+ * kbuf:	Kernel copy of the framed packets.
+ * count:	Number of bytes in @kbuf.
+ * nowait:	Send only what can go out without waiting.
+ *
+ * All frames are validated and their tokens registered before anything is
+ * sent, so a malformed batch never reaches the DSP. The packets are then
+ * queued as one transmit request and sent back to back.
+ *
+ * Return: number of bytes consumed, which is short of @count if the
+ * transport failed part way through, or a negative error code if no
+ * packet was sent: -EAGAIN if @nowait and the transmit path is busy.
+ */
+static ssize_t audio_pkt_send_frames(struct audio_pkt_client *client,
+				     void *kbuf, size_t count, bool nowait)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct gpr_port_map route = { .client = client };
+	struct gpr_hdr *audpkt_hdr;
+	size_t off, prepared;
+	ssize_t len, sent;
+	int ret = 0;
+
+	for (off = 0; off < count; off += len) {
+		len = audio_pkt_frame_len(kbuf + off, count - off);
+		if (len < 0) {
+			AUDIO_PKT_ERR("malformed GPR frame at offset %zu\n", off);
+			return len;
+		}
+	}
+
+	for (prepared = 0; prepared < count; prepared += len) {
+		audpkt_hdr = kbuf + prepared;
+		len = audio_pkt_frame_len(audpkt_hdr, count - prepared);
+		ret = audio_pkt_prepare_pkt(audpkt_dev, audpkt_hdr, &route);
+		if (ret < 0)
+			goto unmap_tokens;
+	}
+
+	if (nowait)
+		sent = audio_pkt_tx_try_send(audpkt_dev, &client->txq, kbuf, count);
+	else
+		sent = audio_pkt_tx_send(audpkt_dev, &client->txq, kbuf, count);
+	if (sent == count)
+		return count;
+
+	prepared = count;
+	if (sent < 0) {
+		ret = sent;
+		sent = 0;
+	}
+	off = sent;
+	goto unmap_from;
+
+unmap_tokens:
+	sent = 0;
+	off = 0;
+unmap_from:
+	/* Drop the routing entries of packets that never reached the DSP */
+	for (; off < prepared; off += len) {
+		audpkt_hdr = kbuf + off;
+		len = audio_pkt_frame_len(audpkt_hdr, count - off);
+		audio_pkt_unmap_token(audpkt_dev, audpkt_hdr->token);
+	}
+
+	return sent ? sent : ret;
+}
+
+/**
+ * audio_pkt_write_iter() - write()/writev() syscall for the audio_pkt device
+ * iocb:	Pointer to the kernel I/O control block.
+ * from:	Iterator over the userspace buffers.
+ *
+ * This function is used to write the data to audio pkt device when
+ * userspace client do a write() or writev() system call. The buffers may
+ * carry several GPR packets framed back to back, which are sent to the
+ * DSP in order as one batch.
+ */
+static ssize_t audio_pkt_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct audio_pkt_client *client = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	ssize_t ret;
+	void *kbuf;
+
+	if (!client)  {
+		AUDIO_PKT_ERR("invalid device handle\n");
+		return -EINVAL;
+	}
+
+	if (!count)
+		return 0;
+
+	if (count > AUDIO_PKT_MAX_WRITE_SIZE)
+		return -EINVAL;
+
+	kbuf = kvmalloc(count, GFP_KERNEL_ACCOUNT);
+	if (!kbuf)
+		return -ENOMEM;
+
+	if (!copy_from_iter_full(kbuf, count, from)) {
+		ret = -EFAULT;
+		goto free_kbuf;
+	}
+
+	/* Non-blocking writers pace themselves on POLLOUT */
+	ret = audio_pkt_send_frames(client, kbuf, count,
+				    (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+				    (iocb->ki_flags & IOCB_NOWAIT));
+
+free_kbuf:
+	kvfree(kbuf);
+	return ret;
+}
+
+/**
+ * audio_pkt_transact() - Send a GPR packet and wait for its response
+ * client:	Client sending the packet.
+ * audpkt_hdr:	Validated GPR packet, prepared in place.
+ * timeout_ms:	Time to wait for the response.
+ * rsp:		Returns the response, to be freed by the caller.
+ *
+ * The response carrying the token of the packet is handed directly to
+ * the calling thread through its entry in the token table; it never goes
+ * through the shared read queue.
+ */
+static long audio_pkt_transact(struct audio_pkt_client *client,
+			       struct gpr_hdr *audpkt_hdr, unsigned int timeout_ms,
+			       struct sk_buff **rsp)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct audio_pkt_txn txn = { .skb = NULL };
+	struct gpr_port_map route = { .client = client, .txn = &txn };
+	uint32_t token;
+	long ret;
+
+	init_completion(&txn.done);
+	ret = audio_pkt_prepare_pkt(audpkt_dev, audpkt_hdr, &route);
+	if (ret < 0)
+		return ret;
+
+	token = audpkt_hdr->token;
+
+	ret = audio_pkt_tx_send(audpkt_dev, &client->txq, audpkt_hdr, audpkt_hdr->pkt_size);
+	if (ret < 0) {
+		audio_pkt_unmap_token(audpkt_dev, token);
+		return ret;
+	}
+
+	ret = wait_for_completion_interruptible_timeout(&txn.done,
+							msecs_to_jiffies(timeout_ms));
+	if (ret <= 0) {
+		if (audio_pkt_claim_token(audpkt_dev, token, &route)) {
+			if (!ret)
+				AUDIO_PKT_ERR("response timeout for token=%u\n", token);
+			/* The command was sent, so it must not be restarted */
+			return ret ? -EINTR : -ETIMEDOUT;
+		}
+		/* Lost the race against the response, which is on its way */
+		wait_for_completion(&txn.done);
+	}
+
+	if (!txn.skb)
+		return txn.status;
+
+	*rsp = txn.skb;
+	return 0;
+}
+
+/**
+ * struct audio_pkt_cmd - internal command in flight
+ * @txn:	completed by the GPR callback with the response
+ * @token:	kernel token of the command
+ * @opcode:	opcode of the command
+ * @deadline:	jiffies after which the response is no longer awaited
+ */
+struct audio_pkt_cmd {
+	struct audio_pkt_txn txn;
+	u32 token;
+	u32 opcode;
+	unsigned long deadline;
+};
+
+/**
+ * q6apm_audio_cmd_submit() - Send an internal command without waiting
+ * apm:		Pointer to the audio pkt device.
+ * pkt:		Command to send, its token is assigned here.
+ * timeout_ms:	Time allowed for the response, from now.
+ * cmd:		Tracks the command until q6apm_audio_cmd_wait().
+ *
+ * Up to cmd_window commands may be outstanding; each is tracked by its
+ * own token, so callers can pipeline several commands and wait for them
+ * afterwards instead of paying a round trip each.
+ */
+static int q6apm_audio_cmd_submit(struct q6apm_audio_pkt *apm, struct gpr_pkt *pkt,
+				  unsigned int timeout_ms, struct audio_pkt_cmd *cmd)
+{
+	struct gpr_port_map route = { .txn = &cmd->txn };
+	ssize_t ret;
+
+	cmd->txn.skb = NULL;
+	init_completion(&cmd->txn.done);
+	cmd->opcode = pkt->hdr.opcode;
+	cmd->deadline = jiffies + msecs_to_jiffies(timeout_ms);
+
+	if (down_timeout(&apm->cmd_window, msecs_to_jiffies(timeout_ms)))
+		return -ETIMEDOUT;
+
+	ret = audio_pkt_prepare_pkt(apm, &pkt->hdr, &route);
+	if (ret < 0)
+		goto release_slot;
+
+	cmd->token = pkt->hdr.token;
+	ret = audio_pkt_tx_send(apm, &apm->kernel_txq, pkt, pkt->hdr.pkt_size);
+	if (ret < 0) {
+		audio_pkt_unmap_token(apm, cmd->token);
+		goto release_slot;
+	}
+
+	return 0;
+
+release_slot:
+	up(&apm->cmd_window);
+	return ret;
+}
+
+/**
+ * q6apm_audio_cmd_wait() - Wait for the response of an internal command
+ * apm:		Pointer to the audio pkt device.
+ * cmd:		Command returned by q6apm_audio_cmd_submit().
+ * rsp_word:	Returns the first payload word of a response other than
+ *		GPR_BASIC_RSP_RESULT, may be NULL.
+ */
+static int q6apm_audio_cmd_wait(struct q6apm_audio_pkt *apm, struct audio_pkt_cmd *cmd,
+				u32 *rsp_word)
+{
+	struct gpr_port_map route = { .txn = &cmd->txn };
+	struct gpr_ibasic_rsp_result_t *result;
+	long left = cmd->deadline - jiffies;
+	struct gpr_hdr *hdr;
+	size_t payload_size;
+	int ret;
+
+	if (!wait_for_completion_timeout(&cmd->txn.done, max(left, 0L))) {
+		if (audio_pkt_claim_token(apm, cmd->token, &route)) {
+			dev_err(apm->dev, "CMD timeout for [%x] opcode\n", cmd->opcode);
+			up(&apm->cmd_window);
+			return -ETIMEDOUT;
+		}
+		/* Lost the race against the response, which is on its way */
+		wait_for_completion(&cmd->txn.done);
+	}
+	up(&apm->cmd_window);
+
+	if (!cmd->txn.skb)
+		return cmd->txn.status;
+
+	hdr = (struct gpr_hdr *)cmd->txn.skb->data;
+	payload_size = cmd->txn.skb->len - hdr->hdr_size * 4;
+	result = (void *)hdr + hdr->hdr_size * 4;
+
+	if (payload_size < sizeof(u32)) {
+		ret = -EPROTO;
+	} else if (hdr->opcode == GPR_BASIC_RSP_RESULT) {
+		if (payload_size < sizeof(*result)) {
+			ret = -EPROTO;
+		} else if (result->status) {
+			dev_err(apm->dev, "DSP returned error[%x] %x\n",
+				cmd->opcode, result->status);
+			ret = -EINVAL;
+		} else {
+			/* DSP successfully finished the command */
+			ret = 0;
+		}
+	} else {
+		if (rsp_word)
+			*rsp_word = *(u32 *)result;
+		ret = 0;
+	}
+
+	kfree_skb(cmd->txn.skb);
+	return ret;
+}
+
+static int q6apm_audio_send_cmd(struct q6apm_audio_pkt *apm, struct gpr_pkt *pkt,
+				unsigned int timeout_ms, u32 *rsp_word)
+{
+	struct audio_pkt_cmd cmd;
+	int ret;
+
+	ret = q6apm_audio_cmd_submit(apm, pkt, timeout_ms, &cmd);
+	if (ret < 0)
+		return ret;
+
+	return q6apm_audio_cmd_wait(apm, &cmd, rsp_word);
+}
+
+static int q6apm_audio_get_apm_state(struct q6apm_audio_pkt *apm)
+{
+	struct gpr_pkt *pkt;
+	u32 state = 0;
+	int ret;
+
+	pkt = q6apm_audio_alloc_apm_cmd_pkt(apm, 0, APM_CMD_GET_SPF_STATE, 0);
+	if (IS_ERR(pkt))
+		return PTR_ERR(pkt);
+
+	/* First word of the response is the state */
+	ret = q6apm_audio_send_cmd(apm, pkt, AUDIO_PKT_SEND_WAIT_TIMEOUT_MS, &state);
+
+	kfree(pkt);
+
+	return ret < 0 ? 0 : state;
+}
+
+/* Caller holds state_lock */
+static u32 audio_pkt_user_state(struct q6apm_audio_pkt *apm)
+{
+	switch (READ_ONCE(apm->dsp_state)) {
+	case AUDIO_PKT_DSP_OFFLINE:
+		return AUDIO_PKT_DSP_STATE_OFFLINE;
+	case AUDIO_PKT_DSP_ONLINE:
+		if (READ_ONCE(apm->spf_ready))
+			return AUDIO_PKT_DSP_STATE_READY;
+		fallthrough;
+	default:
+		return AUDIO_PKT_DSP_STATE_BOOTING;
+	}
+}
+
+/*
+ * Publish a change of dsp_state or spf_ready to userspace, as POLLPRI on
+ * the open files and a uevent. Called after either is written, from any
+ * context; the last caller publishes the latest state.
+ */
+static void audio_pkt_state_changed(struct q6apm_audio_pkt *apm)
+{
+	unsigned long flags;
+	u32 state;
+
+	spin_lock_irqsave(&apm->state_lock, flags);
+	state = audio_pkt_user_state(apm);
+	if (state == apm->user_state) {
+		spin_unlock_irqrestore(&apm->state_lock, flags);
+		return;
+	}
+	apm->user_state = state;
+	apm->state_seq++;
+	spin_unlock_irqrestore(&apm->state_lock, flags);
+
+	wake_up_interruptible_poll(&apm->state_wait, EPOLLPRI);
+	queue_work(apm->wq, &apm->state_uevent);
+}
+
+/* Sends the state current when it runs, a quick succession sends one */
+static void audio_pkt_state_uevent(struct work_struct *work)
+{
+	struct q6apm_audio_pkt *apm = container_of(work, struct q6apm_audio_pkt,
+						   state_uevent);
+	static const char *const states[] = {
+		[AUDIO_PKT_DSP_STATE_OFFLINE] = "DSP_STATE=OFFLINE",
+		[AUDIO_PKT_DSP_STATE_BOOTING] = "DSP_STATE=BOOTING",
+		[AUDIO_PKT_DSP_STATE_READY] = "DSP_STATE=READY",
+	};
+	char restarts[32];
+	char *envp[3];
+	unsigned long flags;
+	u32 state;
+
+	spin_lock_irqsave(&apm->state_lock, flags);
+	state = apm->user_state;
+	spin_unlock_irqrestore(&apm->state_lock, flags);
+
+	snprintf(restarts, sizeof(restarts), "DSP_RESTARTS=%u", apm->restarts);
+	envp[0] = (char *)states[state];
+	envp[1] = restarts;
+	envp[2] = NULL;
+	kobject_uevent_env(&apm->dev->kobj, KOBJ_CHANGE, envp);
+}
+
+static void audio_pkt_set_spf_ready(struct q6apm_audio_pkt *apm, bool ready)
+{
+	/* A late answer must not mark a crashed DSP ready */
+	if (READ_ONCE(apm->spf_ready) == ready ||
+	    (ready && READ_ONCE(apm->dsp_state) == AUDIO_PKT_DSP_OFFLINE))
+		return;
+
+	WRITE_ONCE(apm->spf_ready, ready);
+	AUDIO_PKT_INFO("%s APM %s\n", apm->dev_name, ready ? "ready" : "not ready");
+	wake_up_all(&audio_pkt_ready_wait);
+	audio_pkt_state_changed(apm);
+}
+
+/*
+ * Query the APM until it reports ready or the DSP goes offline, with the
+ * spf_ready_poll_next_ms() backoff. The callback caches every answer.
+ */
+static bool audio_pkt_poll_spf_ready(struct q6apm_audio_pkt *apm)
+{
+	unsigned long warn = jiffies + msecs_to_jiffies(SPF_READY_WARN_MS);
+	unsigned int delay_ms = SPF_READY_POLL_MIN_MS;
+	bool warned = false;
+
+	while (q6apm_audio_get_apm_state(apm) <= 0) {
+		if (READ_ONCE(apm->dsp_state) == AUDIO_PKT_DSP_OFFLINE)
+			return false;
+
+		if (!warned && time_after(jiffies, warn)) {
+			dev_warn(apm->dev, "APM of %s not ready after %u ms, still polling\n",
+				 apm->dev_name, SPF_READY_WARN_MS);
+			warned = true;
+		}
+
+		fsleep(delay_ms * USEC_PER_MSEC);
+		delay_ms = spf_ready_poll_next_ms(delay_ms);
+	}
+
+	return true;
+}
+
+/**
+ * q6apm_audio_is_adsp_ready() - Tell whether the APM of the ADSP is ready
+ *
+ * Reads the state cached from the last APM answer, without a round trip
+ * to the DSP.
+ *
+ * Return: true once the APM reported ready, false while it boots or
+ * after the ADSP went down.
+ */
+bool q6apm_audio_is_adsp_ready(void)
+{
+	struct q6apm_audio_pkt *apm = READ_ONCE(audio_pkt_domains[GPR_DOMAIN_ID_ADSP]);
+
+	return apm && READ_ONCE(apm->spf_ready);
+}
+
+/**
+ * q6apm_audio_wait_adsp_ready() - Wait for the APM of the ADSP to be ready
+ * timeout_ms:	how long to wait, in milliseconds.
+ *
+ * Return: 0 once the APM is ready, -ETIMEDOUT otherwise.
+ */
+int q6apm_audio_wait_adsp_ready(unsigned int timeout_ms)
+{
+	if (!wait_event_timeout(audio_pkt_ready_wait, q6apm_audio_is_adsp_ready(),
+				msecs_to_jiffies(timeout_ms)))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+/* Close the sub graphs in @ids, up to AUDIO_PKT_MAX_SUB_GRAPHS at a time */
+static void q6apm_audio_close_graphs(struct q6apm_audio_pkt *apm, const u32 *ids,
+				     unsigned int num)
+{
+	struct apm_graph_mgmt_cmd *mgmt_cmd;
+	struct gpr_pkt *pkt;
+	unsigned int n;
+	int payload_size;
+
+	for (; num; ids += n, num -= n) {
+		n = min_t(unsigned int, num, AUDIO_PKT_MAX_SUB_GRAPHS);
+		payload_size = APM_GRAPH_MGMT_PSIZE(mgmt_cmd, n);
+		pkt = q6apm_audio_alloc_apm_cmd_pkt(apm, payload_size, APM_CMD_GRAPH_CLOSE, 0);
+		if (IS_ERR(pkt))
+			return;
+
+		mgmt_cmd = (void *)pkt + GPR_HDR_SIZE + APM_CMD_HDR_SIZE;
+		mgmt_cmd->num_sub_graphs = n;
+		mgmt_cmd->param_data.module_instance_id = APM_MODULE_INSTANCE_ID;
+		mgmt_cmd->param_data.param_id = APM_PARAM_ID_SUB_GRAPH_LIST;
+		mgmt_cmd->param_data.param_size = payload_size - APM_MODULE_PARAM_DATA_SIZE;
+		memcpy(mgmt_cmd->sub_graph_id_list, ids, n * sizeof(*ids));
+
+		q6apm_audio_send_cmd(apm, pkt, AUDIO_PKT_GRAPH_CLOSE_TIMEOUT_MS, NULL);
+		kfree(pkt);
+	}
+}
+
+static void q6apm_audio_unmap_mem(struct q6apm_audio_pkt *apm, u32 mem_map_handle)
+{
+	struct audio_pkt_apm_cmd_shared_mem_unmap_regions_t *unmap;
+	struct gpr_pkt *pkt;
+
+	pkt = __q6apm_audio_alloc_pkt(apm, sizeof(*unmap), APM_CMD_SHARED_MEM_UNMAP_REGIONS,
+				      0, GPR_APM_MODULE_IID, APM_MODULE_INSTANCE_ID, false);
+	if (IS_ERR(pkt))
+		return;
+
+	unmap = (void *)pkt + GPR_HDR_SIZE;
+	unmap->mem_map_handle = mem_map_handle;
+	q6apm_audio_send_cmd(apm, pkt, AUDIO_PKT_SEND_WAIT_TIMEOUT_MS, NULL);
+	kfree(pkt);
+}
+
+/**
+ * audio_pkt_client_teardown() - Release the DSP resources of a closed file
+ * work:	teardown work of the client.
+ *
+ * Only the sub graphs and memory maps the client left behind are
+ * released, graphs first as they may use the memory, so other clients
+ * keep running and close() never waits for the DSP.
+ */
+static void audio_pkt_client_teardown(struct work_struct *work)
+{
+	struct audio_pkt_client *client = container_of(work, struct audio_pkt_client,
+						       teardown);
+	struct q6apm_audio_pkt *apm = client->audpkt_dev;
+	struct audio_pkt_mem_map *map;
+	unsigned int num = 0;
+	unsigned long id;
+	void *entry;
+	u32 *ids;
+
+	xa_for_each(&client->owned_graphs, id, entry)
+		num++;
+
+	if (num) {
+		ids = kcalloc(num, sizeof(*ids), GFP_KERNEL);
+		if (ids) {
+			num = 0;
+			xa_for_each(&client->owned_graphs, id, entry)
+				ids[num++] = id;
+			q6apm_audio_close_graphs(apm, ids, num);
+			kfree(ids);
+		}
+	}
+
+	mutex_lock(&client->maps_lock);
+	xa_for_each(&client->owned_maps, id, map) {
+		/* Claimed, a late unmap response may release it too */
+		map = xa_erase(&client->owned_maps, id);
+		if (!map)
+			continue;
+		q6apm_audio_unmap_mem(apm, map->dsp_handle);
+		call_rcu(&map->rcu, audio_pkt_mem_map_free_rcu);
+	}
+	xa_destroy(&client->owned_maps);
+	mutex_unlock(&client->maps_lock);
+
+	xa_for_each(&client->pending_maps, id, map)
+		audio_pkt_mem_map_free(map);
+	xa_destroy(&client->pending_maps);
+
+	xa_for_each(&client->pending_tracks, id, entry)
+		kfree(entry);
+	xa_destroy(&client->pending_tracks);
+
+	xa_destroy(&client->owned_graphs);
+	audio_pkt_client_put(client);
+}
+
+/**
+ * audio_pkt_send_wait() - Send a GPR packet and wait for its response
+ * client:	Client sending the packet.
+ * argp:	Userspace pointer to struct audio_pkt_send_wait.
+ */
+static long audio_pkt_send_wait(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_send_wait req;
+	struct sk_buff *rsp;
+	size_t len;
+	void *kbuf;
+	long ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.reserved || req.pkt_len < GPR_HDR_SIZE ||
+	    req.pkt_len > AUDIO_PKT_MAX_PKT_SIZE)
+		return -EINVAL;
+
+	kbuf = kmalloc(req.pkt_len, GFP_KERNEL_ACCOUNT);
+	if (!kbuf)
+		return -ENOMEM;
+
+	if (copy_from_user(kbuf, u64_to_user_ptr(req.pkt_addr), req.pkt_len)) {
+		ret = -EFAULT;
+		goto free_kbuf;
+	}
+
+	/* A single packet, nothing may follow it */
+	if (audio_pkt_frame_len(kbuf, req.pkt_len) != req.pkt_len) {
+		ret = -EINVAL;
+		goto free_kbuf;
+	}
+
+	ret = audio_pkt_transact(client, kbuf,
+				 req.timeout_ms ?: AUDIO_PKT_SEND_WAIT_TIMEOUT_MS, &rsp);
+	if (ret < 0)
+		goto free_kbuf;
+
+	len = min_t(size_t, req.rsp_len, rsp->len);
+	if (copy_to_user(u64_to_user_ptr(req.rsp_addr), rsp->data, len)) {
+		ret = -EFAULT;
+	} else {
+		req.rsp_len = len;
+		if (copy_to_user(argp, &req, sizeof(req)))
+			ret = -EFAULT;
+	}
+	kfree_skb(rsp);
+
+free_kbuf:
+	kfree(kbuf);
+	return ret;
+}
+
+/**
+ * audio_pkt_graph_mgmt() - Prepare, start or stop several sub graphs at once
+ * client:	Client issuing the command.
+ * argp:	Userspace pointer to struct audio_pkt_graph_mgmt.
+ *
+ * All sub graphs go to the APM in a single command, sent no earlier than
+ * the optional deadline, so they change state together at the cost of a
+ * single round trip. Return: 0 when the DSP accepted the command, -EIO
+ * with the DSP status reported back when it did not.
+ */
+static long audio_pkt_graph_mgmt(struct audio_pkt_client *client, void __user *argp)
+{
+	struct gpr_ibasic_rsp_result_t *result;
+	struct audio_pkt_graph_mgmt req;
+	struct apm_graph_mgmt_cmd *mgmt_cmd;
+	struct sk_buff *rsp = NULL;
+	struct gpr_hdr *rsp_hdr;
+	struct gpr_pkt *pkt;
+	int payload_size;
+	ktime_t deadline;
+	u32 *ids;
+	long ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.opcode != APM_CMD_GRAPH_PREPARE && req.opcode != APM_CMD_GRAPH_START &&
+	    req.opcode != APM_CMD_GRAPH_STOP)
+		return -EINVAL;
+
+	if (!req.num_sub_graphs || req.num_sub_graphs > AUDIO_PKT_MAX_SUB_GRAPHS)
+		return -EINVAL;
+
+	ids = memdup_array_user(u64_to_user_ptr(req.sub_graph_ids_addr),
+				req.num_sub_graphs, sizeof(*ids));
+	if (IS_ERR(ids))
+		return PTR_ERR(ids);
+
+	payload_size = APM_GRAPH_MGMT_PSIZE(mgmt_cmd, req.num_sub_graphs);
+	pkt = q6apm_audio_alloc_apm_cmd_pkt(client->audpkt_dev, payload_size, req.opcode, 0);
+	if (IS_ERR(pkt)) {
+		ret = PTR_ERR(pkt);
+		goto free_ids;
+	}
+
+	mgmt_cmd = (void *)pkt + GPR_HDR_SIZE + APM_CMD_HDR_SIZE;
+	mgmt_cmd->num_sub_graphs = req.num_sub_graphs;
+	mgmt_cmd->param_data.module_instance_id = APM_MODULE_INSTANCE_ID;
+	mgmt_cmd->param_data.param_id = APM_PARAM_ID_SUB_GRAPH_LIST;
+	mgmt_cmd->param_data.param_size = payload_size - APM_MODULE_PARAM_DATA_SIZE;
+	memcpy(mgmt_cmd->sub_graph_id_list, ids, req.num_sub_graphs * sizeof(*ids));
+
+	if (req.deadline_ns) {
+		/* Nothing was sent yet, so the call can simply be restarted */
+		deadline = ns_to_ktime(req.deadline_ns);
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS)) {
+			ret = -ERESTARTSYS;
+			goto free_pkt;
+		}
+	}
+
+	ret = audio_pkt_transact(client, &pkt->hdr, req.timeout_ms ?:
+				 AUDIO_PKT_SEND_WAIT_TIMEOUT_MS, &rsp);
+	if (ret < 0)
+		goto free_pkt;
+
+	rsp_hdr = (struct gpr_hdr *)rsp->data;
+	if (rsp_hdr->opcode != GPR_BASIC_RSP_RESULT ||
+	    rsp->len < rsp_hdr->hdr_size * 4 + sizeof(*result)) {
+		ret = -EPROTO;
+		goto free_rsp;
+	}
+
+	result = (void *)rsp->data + rsp_hdr->hdr_size * 4;
+	req.status = result->status;
+	ret = result->status ? -EIO : 0;
+	if (copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+free_rsp:
+	kfree_skb(rsp);
+free_pkt:
+	kfree(pkt);
+free_ids:
+	kfree(ids);
+	return ret;
+}
+
+/**
+ * audio_pkt_set_coalesce() - Set the receive wakeup coalescing of a client
+ * client:	Client to configure.
+ * argp:	User pointer to a struct audio_pkt_coalesce.
+ */
+static long audio_pkt_set_coalesce(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_coalesce coalesce;
+	unsigned long flags;
+	bool wake;
+
+	if (copy_from_user(&coalesce, argp, sizeof(coalesce)))
+		return -EFAULT;
+
+	if (!coalesce.max_pkts || (coalesce.max_pkts > 1 && !coalesce.max_usecs))
+		return -EINVAL;
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	client->coalesce = coalesce;
+	/* Do not hold back what was queued under the old settings */
+	wake = client->coalesce_pending;
+	client->coalesce_pending = 0;
+	hrtimer_try_to_cancel(&client->coalesce_timer);
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&client->readq);
+
+	return 0;
+}
+
+/**
+ * audio_pkt_set_tx_sched() - Set the transmit scheduling of a client
+ * client:	Client to configure.
+ * argp:	User pointer to a struct audio_pkt_tx_sched.
+ *
+ * The real-time class is reserved to CAP_SYS_NICE, as it can starve
+ * every other client.
+ */
+static long audio_pkt_set_tx_sched(struct audio_pkt_client *client, void __user *argp)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct audio_pkt_tx_queue *txq = &client->txq;
+	struct audio_pkt_tx_sched sched;
+	unsigned long flags;
+
+	if (copy_from_user(&sched, argp, sizeof(sched)))
+		return -EFAULT;
+
+	if (!sched.weight || sched.weight > AUDIO_PKT_MAX_TX_WEIGHT ||
+	    sched.sched_class >= AUDIO_PKT_TX_NUM_CLASSES)
+		return -EINVAL;
+
+	if (sched.sched_class == AUDIO_PKT_TX_CLASS_RT && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	spin_lock_irqsave(&audpkt_dev->tx_lock, flags);
+	txq->weight = sched.weight;
+	if (txq->sched_class != sched.sched_class) {
+		txq->sched_class = sched.sched_class;
+		if (!list_empty(&txq->node))
+			list_move_tail(&txq->node, &audpkt_dev->tx_active[txq->sched_class]);
+	}
+	spin_unlock_irqrestore(&audpkt_dev->tx_lock, flags);
+
+	return 0;
+}
+
+static long audio_pkt_set_busy_poll(struct audio_pkt_client *client,
+				    u32 __user *argp)
+{
+	u32 usecs;
+
+	if (get_user(usecs, argp))
+		return -EFAULT;
+
+	if (usecs > AUDIO_PKT_MAX_BUSY_POLL_USECS)
+		return -EINVAL;
+
+	WRITE_ONCE(client->busy_poll_usecs, usecs);
+
+	return 0;
+}
+
+static long audio_pkt_get_stats(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_stats stats = {
+		.busy_poll_spins = atomic64_read(&client->busy_poll_spins),
+		.busy_poll_hits = atomic64_read(&client->busy_poll_hits),
+		.tokens_expired = atomic_read(&client->audpkt_dev->tokens_expired),
+		.tx_congestions = atomic64_read(&client->audpkt_dev->tx_congestions),
+	};
+	unsigned long flags;
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	stats.rx_queued_pkts = audio_pkt_client_qlen(client);
+	stats.rx_queued_bytes = client->rx_bytes;
+	stats.rx_dropped_pkts = client->rx_dropped_pkts;
+	stats.rx_dropped_bytes = client->rx_dropped_bytes;
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	if (copy_to_user(argp, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long audio_pkt_get_dsp_state(struct audio_pkt_client *client, void __user *argp)
+{
+	struct q6apm_audio_pkt *apm = client->audpkt_dev;
+	struct audio_pkt_dsp_state state = { 0 };
+	unsigned long flags;
+
+	spin_lock_irqsave(&apm->state_lock, flags);
+	state.state = apm->user_state;
+	state.seq = apm->state_seq;
+	state.restarts = apm->restarts;
+	spin_unlock_irqrestore(&apm->state_lock, flags);
+
+	if (copy_to_user(argp, &state, sizeof(state)))
+		return -EFAULT;
+
+	/* Only a change the caller has not seen raises POLLPRI again */
+	WRITE_ONCE(client->dsp_state_seq, state.seq);
+
+	return 0;
+}
+
+static long audio_pkt_set_rx_limit(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_rx_limit limit;
+	struct sk_buff_head dropped;
+	unsigned long flags;
+
+	if (copy_from_user(&limit, argp, sizeof(limit)))
+		return -EFAULT;
+
+	if (!limit.max_pkts || !limit.max_bytes || limit.reserved ||
+	    limit.policy > AUDIO_PKT_RX_DROP_OLDEST)
+		return -EINVAL;
+
+	__skb_queue_head_init(&dropped);
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	client->rx_limit = limit;
+	/* Trim what the new limits no longer allow, whatever the policy */
+	while (audio_pkt_client_qlen(client) > limit.max_pkts ||
+	       client->rx_bytes > limit.max_bytes) {
+		struct sk_buff *skb = NULL;
+		int lane;
+
+		for (lane = AUDIO_PKT_NUM_LANES - 1; lane >= 0 && !skb; lane--)
+			skb = __skb_dequeue_tail(&client->queue[lane]);
+		client->rx_bytes -= skb->len;
+		client->rx_dropped_pkts++;
+		client->rx_dropped_bytes += skb->len;
+		__skb_queue_tail(&dropped, skb);
+	}
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	__skb_queue_purge(&dropped);
+
+	return 0;
+}
+
+/**
+ * audio_pkt_set_filter() - Subscribe a client to DSP events
+ * client:	Client to update.
+ * argp:	Userspace pointer to struct audio_pkt_filter.
+ *
+ * Responses to the client's own commands are always delivered; the
+ * filter only selects which of the packets without a token entry, such
+ * as buffer-done and module events, wake the client.
+ */
+static long audio_pkt_set_filter(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_filter *filter, *old;
+	unsigned long flags;
+
+	filter = memdup_user(argp, sizeof(*filter));
+	if (IS_ERR(filter))
+		return PTR_ERR(filter);
+
+	if (filter->num_opcodes > AUDIO_PKT_MAX_FILTERS ||
+	    filter->num_ports > AUDIO_PKT_MAX_FILTERS) {
+		kfree(filter);
+		return -EINVAL;
+	}
+
+	if (!filter->num_opcodes && !filter->num_ports) {
+		kfree(filter);
+		filter = NULL;
+	}
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	old = rcu_replace_pointer(client->filter, filter,
+				  lockdep_is_held(&client->queue_lock));
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	synchronize_rcu();
+	kfree(old);
+
+	return 0;
+}
+
+static void audio_pkt_stream_free(struct kref *ref)
+{
+	struct audio_pkt_stream *stream = container_of(ref, struct audio_pkt_stream,
+						       refcount);
+
+	if (stream->event)
+		eventfd_ctx_put(stream->event);
+	dma_buf_vunmap_unlocked(stream->ctrl_buf, &stream->ctrl_map);
+	dma_buf_put(stream->ctrl_buf);
+	kfree_rcu(stream, rcu);
+}
+
+static void audio_pkt_stream_put(struct audio_pkt_stream *stream)
+{
+	kref_put(&stream->refcount, audio_pkt_stream_free);
+}
+
+static struct audio_pkt_stream *audio_pkt_stream_get(struct q6apm_audio_pkt *audpkt_dev,
+						      u32 id)
+{
+	struct audio_pkt_stream *stream;
+
+	rcu_read_lock();
+	stream = xa_load(&audpkt_dev->streams, id);
+	if (stream && !kref_get_unless_zero(&stream->refcount))
+		stream = NULL;
+	rcu_read_unlock();
+
+	return stream;
+}
+
+static int audio_pkt_stream_submit(struct audio_pkt_stream *stream, u32 idx)
+{
+	struct audio_pkt_stream_cfg *cfg = &stream->cfg;
+	struct {
+		struct gpr_hdr hdr;
+		union {
+			struct apm_data_cmd_wr_sh_mem_ep_data_buffer_v2 wr;
+			struct data_cmd_rd_sh_mem_ep_data_buffer_v2 rd;
+		};
+	} __packed pkt = { };
+	u64 addr = cfg->buf_addr + (u64)(idx % cfg->num_bufs) * cfg->buf_size;
+	ssize_t ret;
+
+	pkt.hdr.version = GPR_PKT_VER;
+	pkt.hdr.hdr_size = GPR_PKT_HEADER_WORD_SIZE;
+	pkt.hdr.src_domain = GPR_DOMAIN_ID_APPS;
+	pkt.hdr.dest_domain = stream->audpkt_dev->domain_id;
+	pkt.hdr.src_port = GPR_APM_MODULE_IID;
+	pkt.hdr.dest_port = cfg->dst_port;
+	pkt.hdr.token = AUDIO_PKT_STREAM_TOKEN |
+			(stream->id << AUDIO_PKT_STREAM_ID_SHIFT) |
+			(idx & 0xffff);
+
+	if (cfg->direction == AUDIO_PKT_STREAM_PLAYBACK) {
+		pkt.hdr.opcode = DATA_CMD_WR_SH_MEM_EP_DATA_BUFFER_V2;
+		pkt.hdr.pkt_size = GPR_HDR_SIZE + sizeof(pkt.wr);
+		pkt.wr.buf_addr_lsw = lower_32_bits(addr);
+		pkt.wr.buf_addr_msw = upper_32_bits(addr);
+		pkt.wr.mem_map_handle = cfg->mem_map_handle;
+		pkt.wr.buf_size = cfg->buf_size;
+	} else {
+		pkt.hdr.opcode = DATA_CMD_RD_SH_MEM_EP_DATA_BUFFER_V2;
+		pkt.hdr.pkt_size = GPR_HDR_SIZE + sizeof(pkt.rd);
+		pkt.rd.buf_addr_lsw = lower_32_bits(addr);
+		pkt.rd.buf_addr_msw = upper_32_bits(addr);
+		pkt.rd.mem_map_handle = cfg->mem_map_handle;
+		pkt.rd.buf_size = cfg->buf_size;
+	}
+
+	ret = audio_pkt_tx_send(stream->audpkt_dev, &stream->audpkt_dev->kernel_txq,
+				&pkt, pkt.hdr.pkt_size);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Submit every buffer userspace made available: filled buffers for
+ * playback, released ones for capture. Called with the stream lock held.
+ * A buffer is counted as submitted before it is sent, so its return
+ * cannot overtake it.
+ */
+static void __audio_pkt_stream_refill(struct audio_pkt_stream *stream)
+{
+	u32 num_bufs = stream->cfg.num_bufs;
+	u32 head, idx;
+	int ret;
+
+	for (;;) {
+		spin_lock_irq(&stream->ring_lock);
+		if (stream->stopped || stream->submitted - stream->returned >= num_bufs) {
+			spin_unlock_irq(&stream->ring_lock);
+			break;
+		}
+
+		head = smp_load_acquire(&stream->ctrl->head);
+		if (stream->cfg.direction == AUDIO_PKT_STREAM_PLAYBACK ?
+		    (s32)(head - stream->submitted) <= 0 :
+		    stream->submitted - head >= num_bufs) {
+			spin_unlock_irq(&stream->ring_lock);
+			break;
+		}
+		idx = stream->submitted++;
+		spin_unlock_irq(&stream->ring_lock);
+
+		ret = audio_pkt_stream_submit(stream, idx);
+		if (ret < 0) {
+			AUDIO_PKT_ERR("stream %u submit failed ret %d\n", stream->id, ret);
+			WRITE_ONCE(stream->ctrl->status, ret);
+			spin_lock_irq(&stream->ring_lock);
+			stream->submitted--;
+			stream->stopped = true;
+			spin_unlock_irq(&stream->ring_lock);
+			break;
+		}
+	}
+}
+
+static void audio_pkt_stream_refill(struct work_struct *work)
+{
+	struct audio_pkt_stream *stream = container_of(work, struct audio_pkt_stream,
+						       refill);
+
+	mutex_lock(&stream->lock);
+	__audio_pkt_stream_refill(stream);
+	mutex_unlock(&stream->lock);
+
+	audio_pkt_stream_put(stream);
+}
+
+/* A buffer of the stream named by the token of @data came back from the DSP */
+static void audio_pkt_stream_done(struct q6apm_audio_pkt *audpkt_dev,
+				  struct gpr_resp_pkt *data)
+{
+	struct data_cmd_rsp_rd_sh_mem_ep_data_buffer_done_v2 *rd_done;
+	struct data_cmd_rsp_wr_sh_mem_ep_data_buffer_done_v2 *wr_done;
+	struct gpr_ibasic_rsp_result_t *result;
+	struct gpr_hdr *hdr = &data->hdr;
+	struct audio_pkt_stream *stream;
+	u32 status, len = 0;
+	unsigned long flags;
+	bool refill = false;
+
+	switch (hdr->opcode) {
+	case DATA_CMD_RSP_WR_SH_MEM_EP_DATA_BUFFER_DONE_V2:
+		if (data->payload_size < sizeof(*wr_done))
+			return;
+		wr_done = data->payload;
+		status = wr_done->status;
+		break;
+	case DATA_CMD_RSP_RD_SH_MEM_EP_DATA_BUFFER_DONE_V2:
+		if (data->payload_size < sizeof(*rd_done))
+			return;
+		rd_done = data->payload;
+		status = rd_done->status;
+		len = rd_done->data_size;
+		break;
+	case GPR_BASIC_RSP_RESULT:
+		/* The DSP rejected the buffer */
+		if (data->payload_size < sizeof(*result))
+			return;
+		result = data->payload;
+		status = result->status;
+		if (!status)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	stream = audio_pkt_stream_get(audpkt_dev,
+			(hdr->token & ~AUDIO_PKT_STREAM_TOKEN) >> AUDIO_PKT_STREAM_ID_SHIFT);
+	if (!stream)
+		return;
+
+	spin_lock_irqsave(&stream->ring_lock, flags);
+	if (stream->returned != stream->submitted) {
+		if (stream->cfg.direction == AUDIO_PKT_STREAM_CAPTURE)
+			WRITE_ONCE(stream->ctrl->len[stream->returned % stream->cfg.num_bufs],
+				   len);
+		stream->returned++;
+		if (status) {
+			AUDIO_PKT_ERR("stream %u DSP error %x\n", stream->id, status);
+			WRITE_ONCE(stream->ctrl->status, status);
+			stream->stopped = true;
+		}
+		smp_store_release(&stream->ctrl->tail, stream->returned);
+		refill = !stream->stopped;
+	}
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
+
+	if (stream->event)
+		eventfd_signal(stream->event);
+
+	/* The reference goes with the work, unless it is already queued */
+	if (!refill || !queue_work(audpkt_dev->wq, &stream->refill))
+		audio_pkt_stream_put(stream);
+}
+
+/**
+ * audio_pkt_stream_start() - Start an in-kernel stream on an endpoint
+ * client:	Client starting the stream.
+ * argp:	User pointer to a struct audio_pkt_stream_cfg.
+ *
+ * The stream does not submit anything until it is kicked.
+ */
+static int audio_pkt_stream_start(struct audio_pkt_client *client, void __user *argp)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct audio_pkt_stream *stream;
+	struct audio_pkt_stream_cfg cfg;
+	size_t ctrl_size;
+	int ret;
+
+	if (copy_from_user(&cfg, argp, sizeof(cfg)))
+		return -EFAULT;
+
+	if (cfg.reserved || !cfg.buf_size || !cfg.num_bufs ||
+	    cfg.num_bufs > AUDIO_PKT_STREAM_MAX_BUFS ||
+	    cfg.direction > AUDIO_PKT_STREAM_CAPTURE ||
+	    !IS_ALIGNED(cfg.ctrl_offset, sizeof(u32)))
+		return -EINVAL;
+
+	ctrl_size = struct_size_t(struct audio_pkt_stream_ctrl, len, cfg.num_bufs);
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return -ENOMEM;
+
+	kref_init(&stream->refcount);
+	mutex_init(&stream->lock);
+	spin_lock_init(&stream->ring_lock);
+	INIT_WORK(&stream->refill, audio_pkt_stream_refill);
+	stream->audpkt_dev = audpkt_dev;
+	stream->client = client;
+	stream->cfg = cfg;
+	ret = audio_pkt_client_dsp_handle(client, cfg.mem_map_handle,
+					  &stream->cfg.mem_map_handle);
+	if (ret < 0)
+		goto free_stream;
+
+	stream->ctrl_buf = dma_buf_get(cfg.ctrl_fd);
+	if (IS_ERR(stream->ctrl_buf)) {
+		ret = PTR_ERR(stream->ctrl_buf);
+		goto free_stream;
+	}
+
+	if (cfg.ctrl_offset > stream->ctrl_buf->size ||
+	    stream->ctrl_buf->size - cfg.ctrl_offset < ctrl_size) {
+		ret = -EINVAL;
+		goto put_ctrl_buf;
+	}
+
+	ret = dma_buf_vmap_unlocked(stream->ctrl_buf, &stream->ctrl_map);
+	if (ret)
+		goto put_ctrl_buf;
+
+	if (stream->ctrl_map.is_iomem) {
+		ret = -EINVAL;
+		goto vunmap_ctrl_buf;
+	}
+	stream->ctrl = stream->ctrl_map.vaddr + cfg.ctrl_offset;
+
+	if (cfg.event_fd >= 0) {
+		stream->event = eventfd_ctx_fdget(cfg.event_fd);
+		if (IS_ERR(stream->event)) {
+			ret = PTR_ERR(stream->event);
+			goto vunmap_ctrl_buf;
+		}
+	}
+
+	WRITE_ONCE(stream->ctrl->tail, 0);
+	WRITE_ONCE(stream->ctrl->status, 0);
+
+	/* Reserve the id, the stream is only published once userspace has it */
+	ret = xa_alloc(&audpkt_dev->streams, &stream->id, NULL,
+		       XA_LIMIT(1, AUDIO_PKT_STREAM_ID_MAX), GFP_KERNEL);
+	if (ret < 0)
+		goto put_event;
+
+	if (put_user(stream->id, &((struct audio_pkt_stream_cfg __user *)argp)->id)) {
+		xa_release(&audpkt_dev->streams, stream->id);
+		ret = -EFAULT;
+		goto put_event;
+	}
+
+	/* Filling a reserved slot never allocates */
+	xa_store(&audpkt_dev->streams, stream->id, stream, GFP_KERNEL);
+
+	return 0;
+
+put_event:
+	if (stream->event)
+		eventfd_ctx_put(stream->event);
+vunmap_ctrl_buf:
+	dma_buf_vunmap_unlocked(stream->ctrl_buf, &stream->ctrl_map);
+put_ctrl_buf:
+	dma_buf_put(stream->ctrl_buf);
+free_stream:
+	kfree(stream);
+	return ret;
+}
+
+/* Submit the buffers userspace made available since the last return */
+static int audio_pkt_stream_kick(struct audio_pkt_client *client, u32 __user *argp)
+{
+	struct audio_pkt_stream *stream;
+	int ret = 0;
+	u32 id;
+
+	if (get_user(id, argp))
+		return -EFAULT;
+
+	stream = audio_pkt_stream_get(client->audpkt_dev, id);
+	if (!stream)
+		return -ENOENT;
+
+	if (stream->client != client) {
+		ret = -EPERM;
+		goto put_stream;
+	}
+
+	mutex_lock(&stream->lock);
+	if (READ_ONCE(stream->stopped))
+		ret = -EPIPE;
+	else
+		__audio_pkt_stream_refill(stream);
+	mutex_unlock(&stream->lock);
+
+put_stream:
+	audio_pkt_stream_put(stream);
+	return ret;
+}
+
+/*
+ * Remove @stream from the stream table. Buffers still held by the DSP
+ * are dropped when they come back, so the graph must be stopped before
+ * the ring is unmapped.
+ */
+static void audio_pkt_stream_stop(struct audio_pkt_stream *stream)
+{
+	struct q6apm_audio_pkt *audpkt_dev = stream->audpkt_dev;
+
+	if (xa_cmpxchg(&audpkt_dev->streams, stream->id, stream, NULL, 0) != stream)
+		return;
+
+	spin_lock_irq(&stream->ring_lock);
+	stream->stopped = true;
+	spin_unlock_irq(&stream->ring_lock);
+
+	audio_pkt_stream_put(stream);
+}
+
+static int audio_pkt_stream_stop_id(struct audio_pkt_client *client, u32 __user *argp)
+{
+	struct audio_pkt_stream *stream;
+	int ret = 0;
+	u32 id;
+
+	if (get_user(id, argp))
+		return -EFAULT;
+
+	stream = audio_pkt_stream_get(client->audpkt_dev, id);
+	if (!stream)
+		return -ENOENT;
+
+	if (stream->client == client)
+		audio_pkt_stream_stop(stream);
+	else
+		ret = -EPERM;
+
+	audio_pkt_stream_put(stream);
+	return ret;
+}
+
+static void audio_pkt_client_stop_streams(struct audio_pkt_client *client)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct audio_pkt_stream *stream;
+	unsigned long id;
+
+	xa_for_each(&audpkt_dev->streams, id, stream)
+		if (stream->client == client)
+			audio_pkt_stream_stop(stream);
+}
+
+/*
+ * Stop every stream with @err in its status word, for instance when the
+ * DSP crashed with buffers that will never come back. The streams stay
+ * in the table until their owner stops them.
+ */
+static void audio_pkt_fail_streams(struct q6apm_audio_pkt *audpkt_dev, int err)
+{
+	struct audio_pkt_stream *stream;
+	unsigned long id;
+
+	xa_for_each(&audpkt_dev->streams, id, stream) {
+		stream = audio_pkt_stream_get(audpkt_dev, id);
+		if (!stream)
+			continue;
+
+		spin_lock_irq(&stream->ring_lock);
+		if (!stream->stopped) {
+			WRITE_ONCE(stream->ctrl->status, err);
+			stream->stopped = true;
+		}
+		spin_unlock_irq(&stream->ring_lock);
+
+		if (stream->event)
+			eventfd_signal(stream->event);
+		audio_pkt_stream_put(stream);
+	}
+}
+
+/**
+ * audio_pkt_template_add() - Upload a packet to replay by handle
+ * client:	Client owning the template.
+ * argp:	User pointer to a struct audio_pkt_template.
+ */
+static long audio_pkt_template_add(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_template __user *utmpl = argp;
+	struct audio_pkt_template_buf *buf;
+	struct audio_pkt_template tmpl;
+	u32 handle;
+	int ret;
+
+	if (copy_from_user(&tmpl, utmpl, sizeof(tmpl)))
+		return -EFAULT;
+
+	if (tmpl.len < GPR_HDR_SIZE || tmpl.len > AUDIO_PKT_MAX_PKT_SIZE)
+		return -EINVAL;
+
+	buf = kvmalloc(struct_size(buf, data, tmpl.len), GFP_KERNEL_ACCOUNT);
+	if (!buf)
+		return -ENOMEM;
+
+	buf->len = tmpl.len;
+	if (copy_from_user(buf->data, u64_to_user_ptr(tmpl.addr), tmpl.len)) {
+		ret = -EFAULT;
+		goto free_buf;
+	}
+
+	if (audio_pkt_frame_len(buf->data, buf->len) != buf->len) {
+		ret = -EINVAL;
+		goto free_buf;
+	}
+
+	mutex_lock(&client->template_lock);
+	ret = xa_alloc(&client->templates, &handle, buf,
+		       XA_LIMIT(1, AUDIO_PKT_MAX_TEMPLATES), GFP_KERNEL);
+	mutex_unlock(&client->template_lock);
+	if (ret < 0)
+		goto free_buf;
+
+	if (put_user(handle, &utmpl->handle)) {
+		mutex_lock(&client->template_lock);
+		xa_erase(&client->templates, handle);
+		mutex_unlock(&client->template_lock);
+		ret = -EFAULT;
+		goto free_buf;
+	}
+
+	return 0;
+
+free_buf:
+	kvfree(buf);
+	return ret;
+}
+
+/**
+ * audio_pkt_template_send() - Send a copy of a template with words patched
+ * client:	Client owning the template.
+ * argp:	User pointer to a struct audio_pkt_template_send.
+ *
+ * The copy goes through the same validation and token handling as a
+ * packet written to the device. Return: 0 on success.
+ */
+static long audio_pkt_template_send(struct audio_pkt_client *client, void __user *argp)
+{
+	struct audio_pkt_template_patch *patches = NULL;
+	struct audio_pkt_template_send req;
+	struct audio_pkt_template_buf *buf;
+	size_t len;
+	void *kbuf;
+	ssize_t ret;
+	u32 i;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.num_patches > AUDIO_PKT_MAX_TEMPLATE_PATCHES)
+		return -EINVAL;
+
+	if (req.num_patches) {
+		patches = memdup_array_user(u64_to_user_ptr(req.patches_addr),
+					    req.num_patches, sizeof(*patches));
+		if (IS_ERR(patches))
+			return PTR_ERR(patches);
+	}
+
+	mutex_lock(&client->template_lock);
+	buf = xa_load(&client->templates, req.handle);
+	if (!buf) {
+		mutex_unlock(&client->template_lock);
+		ret = -ENOENT;
+		goto free_patches;
+	}
+
+	len = buf->len;
+	kbuf = kvmalloc(len, GFP_KERNEL);
+	if (kbuf)
+		memcpy(kbuf, buf->data, len);
+	mutex_unlock(&client->template_lock);
+	if (!kbuf) {
+		ret = -ENOMEM;
+		goto free_patches;
+	}
+
+	/* The first word holds the packet size and may not change */
+	for (i = 0; i < req.num_patches; i++) {
+		if (patches[i].offset < sizeof(u32) ||
+		    !IS_ALIGNED(patches[i].offset, sizeof(u32)) ||
+		    patches[i].offset > len - sizeof(u32)) {
+			ret = -EINVAL;
+			goto free_kbuf;
+		}
+		*(u32 *)(kbuf + patches[i].offset) = patches[i].value;
+	}
+
+	ret = audio_pkt_send_frames(client, kbuf, len, false);
+	if (ret >= 0)
+		ret = ret == len ? 0 : -EIO;
+
+free_kbuf:
+	kvfree(kbuf);
+free_patches:
+	kfree(patches);
+	return ret;
+}
+
+static long audio_pkt_template_del(struct audio_pkt_client *client, u32 __user *argp)
+{
+	struct audio_pkt_template_buf *buf;
+	u32 handle;
+
+	if (get_user(handle, argp))
+		return -EFAULT;
+
+	mutex_lock(&client->template_lock);
+	buf = xa_erase(&client->templates, handle);
+	mutex_unlock(&client->template_lock);
+	if (!buf)
+		return -ENOENT;
+
+	kvfree(buf);
+
+	return 0;
+}
+
+static void audio_pkt_client_free_templates(struct audio_pkt_client *client)
+{
+	struct audio_pkt_template_buf *buf;
+	unsigned long handle;
+
+	mutex_lock(&client->template_lock);
+	xa_for_each(&client->templates, handle, buf)
+		kvfree(buf);
+	xa_destroy(&client->templates);
+	mutex_unlock(&client->template_lock);
+}
+
+/**
+ * audio_pkt_ioctl() - ioctl() syscall for the audio_pkt device
+ * file:	Pointer to the file structure.
+ * cmd:		ioctl command.
+ * arg:		ioctl argument.
+ */
+static long audio_pkt_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct audio_pkt_client *client = file->private_data;
+	void __user *argp = (void __user *)arg;
+
+	if (!client) {
+		AUDIO_PKT_ERR("invalid device handle\n");
+		return -EINVAL;
+	}
+
+	switch (cmd) {
+	case AUDIO_PKT_IOCTL_SEND_WAIT:
+		return audio_pkt_send_wait(client, argp);
+	case AUDIO_PKT_IOCTL_SET_FILTER:
+		return audio_pkt_set_filter(client, argp);
+	case AUDIO_PKT_IOCTL_SET_COALESCE:
+		return audio_pkt_set_coalesce(client, argp);
+	case AUDIO_PKT_IOCTL_SET_BUSY_POLL:
+		return audio_pkt_set_busy_poll(client, argp);
+	case AUDIO_PKT_IOCTL_GET_STATS:
+		return audio_pkt_get_stats(client, argp);
+	case AUDIO_PKT_IOCTL_GET_DSP_STATE:
+		return audio_pkt_get_dsp_state(client, argp);
+	case AUDIO_PKT_IOCTL_SET_RX_LIMIT:
+		return audio_pkt_set_rx_limit(client, argp);
+	case AUDIO_PKT_IOCTL_TEMPLATE_ADD:
+		return audio_pkt_template_add(client, argp);
+	case AUDIO_PKT_IOCTL_TEMPLATE_SEND:
+		return audio_pkt_template_send(client, argp);
+	case AUDIO_PKT_IOCTL_TEMPLATE_DEL:
+		return audio_pkt_template_del(client, argp);
+	case AUDIO_PKT_IOCTL_GRAPH_MGMT:
+		return audio_pkt_graph_mgmt(client, argp);
+	case AUDIO_PKT_IOCTL_SET_TX_SCHED:
+		return audio_pkt_set_tx_sched(client, argp);
+	case AUDIO_PKT_IOCTL_STREAM_START:
+		return audio_pkt_stream_start(client, argp);
+	case AUDIO_PKT_IOCTL_STREAM_KICK:
+		return audio_pkt_stream_kick(client, argp);
+	case AUDIO_PKT_IOCTL_STREAM_STOP:
+		return audio_pkt_stream_stop_id(client, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static void audio_pkt_uring_task_cb(struct io_uring_cmd *ioucmd,
+				    unsigned int issue_flags)
+{
+	struct audio_pkt_uring_req *ureq =
+		io_uring_cmd_to_pdu(ioucmd, struct audio_pkt_uring_pdu)->ureq;
+	struct sk_buff *skb = ureq->skb;
+	ssize_t ret = ureq->status;
+
+	if (skb) {
+		ret = min_t(size_t, ureq->len, skb->len);
+		if (copy_to_user(ureq->ubuf, skb->data, ret))
+			ret = -EFAULT;
+		kfree_skb(skb);
+	}
+
+	kfree(ureq);
+	io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+/* Hand @skb (or @status if it is NULL) over to a pending io_uring command */
+static void audio_pkt_uring_complete(struct audio_pkt_uring_req *ureq,
+				     struct sk_buff *skb, int status)
+{
+	ureq->skb = skb;
+	ureq->status = status;
+	io_uring_cmd_complete_in_task(ureq->ioucmd, audio_pkt_uring_task_cb);
+}
+
+static int audio_pkt_uring_send(struct audio_pkt_client *client,
+				struct audio_pkt_uring_req *ureq,
+				unsigned int issue_flags)
+{
+	struct q6apm_audio_pkt *audpkt_dev = client->audpkt_dev;
+	struct gpr_port_map route = { .client = client, .ureq = ureq };
+	struct gpr_hdr hdr;
+	void *kbuf;
+	int ret;
+
+	if (ureq->len < sizeof(hdr))
+		return -EINVAL;
+
+	if (copy_from_user(&hdr, ureq->ubuf, sizeof(hdr)))
+		return -EFAULT;
+
+	if (hdr.pkt_size > ureq->len || hdr.pkt_size > AUDIO_PKT_MAX_PKT_SIZE)
+		return -EINVAL;
+
+	kbuf = kmalloc(hdr.pkt_size, GFP_KERNEL_ACCOUNT);
+	if (!kbuf)
+		return -ENOMEM;
+
+	if (copy_from_user(kbuf, ureq->ubuf, hdr.pkt_size)) {
+		ret = -EFAULT;
+		goto free_kbuf;
+	}
+
+	if (audio_pkt_frame_len(kbuf, hdr.pkt_size) < 0) {
+		ret = -EINVAL;
+		goto free_kbuf;
+	}
+
+	ret = audio_pkt_prepare_pkt(audpkt_dev, kbuf, &route);
+	if (ret < 0)
+		goto free_kbuf;
+
+	ureq->token = ((struct gpr_hdr *)kbuf)->token;
+
+	/*
+	 * The submission context must not wait for the transmit path;
+	 * anything but an immediate send is punted to io-wq. The command is
+	 * only marked cancelable once it is queued: inline, the response is
+	 * completed by task work of this very task, which cannot run before
+	 * the issue returns.
+	 */
+	if (issue_flags & IO_URING_F_NONBLOCK) {
+		ret = audio_pkt_tx_try_send(audpkt_dev, &client->txq, kbuf, hdr.pkt_size);
+		if (ret < 0)
+			goto unmap_token;
+		kfree(kbuf);
+		io_uring_cmd_mark_cancelable(ureq->ioucmd, issue_flags);
+		return -EIOCBQUEUED;
+	}
+
+	io_uring_cmd_mark_cancelable(ureq->ioucmd, issue_flags);
+	ret = audio_pkt_tx_send(audpkt_dev, &client->txq, kbuf, hdr.pkt_size);
+	kfree(kbuf);
+	if (ret < 0) {
+		audio_pkt_unmap_token(audpkt_dev, ureq->token);
+		/* Already marked cancelable, so complete through io_uring_cmd_done */
+		ureq->status = ret;
+		audio_pkt_uring_task_cb(ureq->ioucmd, issue_flags);
+	}
+
+	return -EIOCBQUEUED;
+
+unmap_token:
+	audio_pkt_unmap_token(audpkt_dev, ureq->token);
+free_kbuf:
+	kfree(kbuf);
+	return ret;
+}
+
+static int audio_pkt_uring_recv(struct audio_pkt_client *client,
+				struct audio_pkt_uring_req *ureq,
+				unsigned int issue_flags)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	io_uring_cmd_mark_cancelable(ureq->ioucmd, issue_flags);
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	skb = __audio_pkt_client_dequeue(client);
+	if (!skb)
+		list_add_tail(&ureq->node, &client->uring_recvq);
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	/* A packet is already queued, complete inline */
+	if (skb) {
+		ureq->skb = skb;
+		audio_pkt_uring_task_cb(ureq->ioucmd, issue_flags);
+	}
+
+	return -EIOCBQUEUED;
+}
+
+static int audio_pkt_uring_cancel(struct audio_pkt_client *client,
+				  struct io_uring_cmd *ioucmd,
+				  unsigned int issue_flags)
+{
+	struct audio_pkt_uring_req *ureq =
+		io_uring_cmd_to_pdu(ioucmd, struct audio_pkt_uring_pdu)->ureq;
+	struct gpr_port_map route = { .client = client, .ureq = ureq };
+	unsigned long flags;
+	bool claimed = false;
+
+	if (!ureq)
+		return 0;
+
+	if (ureq->is_send) {
+		claimed = audio_pkt_claim_token(client->audpkt_dev, ureq->token, &route);
+	} else {
+		spin_lock_irqsave(&client->queue_lock, flags);
+		if (!list_empty(&ureq->node)) {
+			list_del_init(&ureq->node);
+			claimed = true;
+		}
+		spin_unlock_irqrestore(&client->queue_lock, flags);
+	}
+
+	/* Otherwise the packet already arrived and completion is queued */
+	if (claimed) {
+		kfree(ureq);
+		io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+	}
+
+	return 0;
+}
+
+/**
+ * audio_pkt_uring_cmd() - io_uring command handler for the audio_pkt device
+ * ioucmd:	Pointer to the io_uring command.
+ * issue_flags:	io_uring issue flags.
+ *
+ * AUDIO_PKT_URING_CMD_SEND sends the GPR packet held in the user buffer
+ * and completes once the DSP response with the same token arrives, which
+ * is copied back into the same buffer. AUDIO_PKT_URING_CMD_RECV completes
+ * with the next packet routed to the file that is not claimed by a
+ * pending send.
+ *
+ * Return: -EIOCBQUEUED once the command is queued or completed through
+ * io_uring_cmd_done(), otherwise a negative error code.
+ */
+static int audio_pkt_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct audio_pkt_client *client = ioucmd->file->private_data;
+	const struct audio_pkt_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+	struct audio_pkt_uring_req *ureq;
+	int ret;
+
+	if (!client) {
+		AUDIO_PKT_ERR("invalid device handle\n");
+		return -EINVAL;
+	}
+
+	if (issue_flags & IO_URING_F_CANCEL)
+		return audio_pkt_uring_cancel(client, ioucmd, issue_flags);
+
+	if (ioucmd->cmd_op != AUDIO_PKT_URING_CMD_SEND &&
+	    ioucmd->cmd_op != AUDIO_PKT_URING_CMD_RECV)
+		return -EOPNOTSUPP;
+
+	if (READ_ONCE(cmd->reserved))
+		return -EINVAL;
+
+	ureq = kzalloc(sizeof(*ureq), GFP_KERNEL);
+	if (!ureq)
+		return -ENOMEM;
+
+	ureq->ioucmd = ioucmd;
+	ureq->ubuf = u64_to_user_ptr(READ_ONCE(cmd->addr));
+	ureq->len = READ_ONCE(cmd->len);
+	ureq->is_send = ioucmd->cmd_op == AUDIO_PKT_URING_CMD_SEND;
+	INIT_LIST_HEAD(&ureq->node);
+	io_uring_cmd_to_pdu(ioucmd, struct audio_pkt_uring_pdu)->ureq = ureq;
+
+	if (ureq->is_send)
+		ret = audio_pkt_uring_send(client, ureq, issue_flags);
+	else
+		ret = audio_pkt_uring_recv(client, ureq, issue_flags);
+
+	/* Never queued nor marked cancelable, nothing may find it anymore */
+	if (ret != -EIOCBQUEUED) {
+		io_uring_cmd_to_pdu(ioucmd, struct audio_pkt_uring_pdu)->ureq = NULL;
+		kfree(ureq);
+	}
+
+	return ret;
+}
+
+/**
+ * audio_pkt_poll() - poll() syscall for the audio_pkt device
+ * file:	Pointer to the file structure.
+ * wait:	pointer to Poll table.
+ *
+ * This function is used to poll on the audio pkt device when
+ * userspace client do a poll() system call. All input arguments are
+ * validated by the virtual file system before calling this function.
+ * POLLPRI reports a DSP state change the file has not read yet.
+ */
+static unsigned int audio_pkt_poll(struct file *file, poll_table *wait)
+{
+	struct audio_pkt_client *client = file->private_data;
+	struct q6apm_audio_pkt *audpkt_dev;
+	unsigned int mask = 0;
+
+	if (!client) {
+		AUDIO_PKT_ERR("invalid device handle\n");
+		return POLLERR;
+	}
+	audpkt_dev = client->audpkt_dev;
+
+	poll_wait(file, &client->readq, wait);
+	poll_wait(file, &audpkt_dev->tx_wait, wait);
+	poll_wait(file, &audpkt_dev->state_wait, wait);
+
+	/*
+	 * Readiness is sampled without locks, registering on the wait queues
+	 * above orders these reads against the wakeup of a concurrent
+	 * delivery.
+	 */
+	if (!skb_queue_empty_lockless(&client->queue[AUDIO_PKT_LANE_HIGH]))
+		mask |= POLLIN | POLLRDNORM | POLLRDBAND;
+	else if (!audio_pkt_client_empty(client))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (!READ_ONCE(audpkt_dev->tx_congested) && !READ_ONCE(audpkt_dev->tx_draining))
+		mask |= POLLOUT | POLLWRNORM;
+
+	if (READ_ONCE(client->dsp_state_seq) != READ_ONCE(audpkt_dev->state_seq))
+		mask |= POLLPRI;
+
+	return mask;
+}
+
+static const struct file_operations audio_pkt_fops = {
+	.owner = THIS_MODULE,
+	.open = audio_pkt_open,
+	.release = audio_pkt_release,
+	.read = audio_pkt_read,
+	.write_iter = audio_pkt_write_iter,
+	.poll = audio_pkt_poll,
+	.unlocked_ioctl = audio_pkt_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.uring_cmd = audio_pkt_uring_cmd,
+};
+
+/**
+ * audio_pkt_token_reaper() - Expire tokens the DSP never answered
+ * work:	Pointer to the token_reaper work.
+ *
+ * Runs periodically while commands are outstanding. Threads blocked in
+ * AUDIO_PKT_IOCTL_SEND_WAIT time out on their own and are left alone;
+ * io_uring sends are completed with -ETIMEDOUT.
+ */
+static void audio_pkt_token_reaper(struct work_struct *work)
+{
+	struct q6apm_audio_pkt *apm = container_of(to_delayed_work(work),
+						   struct q6apm_audio_pkt,
+						   token_reaper);
+	unsigned long timeout = msecs_to_jiffies(READ_ONCE(audio_pkt_token_timeout_ms));
+	struct gpr_port_map *audpkt_port_map;
+	unsigned long id;
+	int expired = 0;
+	int pending = 0;
+
+	rcu_read_lock();
+	xa_for_each(&apm->audpkt_tokens, id, audpkt_port_map) {
+		/* Answered entries wait for events, their owner releases them */
+		if (audpkt_port_map->answered)
+			continue;
+
+		if (audpkt_port_map->txn ||
+		    time_before(jiffies, audpkt_port_map->stamp + timeout)) {
+			pending++;
+			continue;
+		}
 
-	strscpy(apm->dev_name, CHANNEL_NAME, 20);
-	strscpy(apm->ch_name, CHANNEL_NAME, 20);
-	dev_set_name(apm->dev, apm->dev_name);
+		if (xa_cmpxchg(&apm->audpkt_tokens, id, audpkt_port_map,
+			       NULL, 0) != audpkt_port_map)
+			continue;
+
+		AUDIO_PKT_ERR("expired token=%lu opcode=0x%x client token=%u\n",
+			      id, audpkt_port_map->opcode, audpkt_port_map->user_token);
+		if (audpkt_port_map->ureq)
+			audio_pkt_uring_complete(audpkt_port_map->ureq, NULL, -ETIMEDOUT);
+		audio_pkt_client_drop_pending(audpkt_port_map->client, id);
+		audio_pkt_client_put(audpkt_port_map->client);
+		kfree_rcu(audpkt_port_map, rcu);
+		expired++;
+	}
+	rcu_read_unlock();
 
+	if (expired)
+		atomic_add(expired, &apm->tokens_expired);
 
-	dev_set_drvdata(dev, apm);
+	if (pending)
+		schedule_delayed_work(&apm->token_reaper,
+				      msecs_to_jiffies(AUDIO_PKT_TOKEN_REAP_INTERVAL_MS));
+}
 
-	mutex_init(&apm->lock);
-	apm->adev = adev;
+/*
+ * Create the device of a DSP domain. It outlives the GPR device, so open
+ * files survive a restart of the DSP.
+ */
+static struct q6apm_audio_pkt *audio_pkt_domain_create(u32 domain_id)
+{
+	struct q6apm_audio_pkt *apm;
+	int ret, sched_class;
 
+	apm = kzalloc(sizeof(*apm), GFP_KERNEL);
+	if (!apm)
+		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&apm->queue_lock);
-	skb_queue_head_init(&apm->queue);
-	init_waitqueue_head(&apm->readq);
+	apm->domain_id = domain_id;
+	if (audio_pkt_domain_names[domain_id])
+		snprintf(apm->dev_name, sizeof(apm->dev_name), "%s_%s",
+			 AUDPKT_DRIVER_NAME, audio_pkt_domain_names[domain_id]);
+	else
+		snprintf(apm->dev_name, sizeof(apm->dev_name), "%s_dsp%u",
+			 AUDPKT_DRIVER_NAME, domain_id);
+	strscpy(apm->ch_name, CHANNEL_NAME, sizeof(apm->ch_name));
 
-	mutex_init(&apm->audpkt_port_lock);
-	idr_init(&apm->audpkt_port_idr);
+	apm->dev = device_create(audio_pkt_class, NULL,
+				 MKDEV(MAJOR(audio_pkt_devt), domain_id), NULL,
+				 "%s", apm->dev_name);
+	if (IS_ERR(apm->dev)) {
+		ret = PTR_ERR(apm->dev);
+		pr_err("device_create failed ret:%ld\n",
+			      PTR_ERR(apm->dev));
+		goto free_apm;
+	}
 
-	g_apm = apm;
+	sema_init(&apm->cmd_window, clamp(audio_pkt_cmd_window, 1U, (unsigned int)INT_MAX));
+
+	spin_lock_init(&apm->clients_lock);
+	INIT_LIST_HEAD(&apm->clients);
+	spin_lock_init(&apm->tx_lock);
+	for (sched_class = 0; sched_class < AUDIO_PKT_TX_NUM_CLASSES; sched_class++)
+		INIT_LIST_HEAD(&apm->tx_active[sched_class]);
+	audio_pkt_txq_init(&apm->kernel_txq, AUDIO_PKT_TX_CLASS_RT);
+	INIT_DELAYED_WORK(&apm->tx_retry, audio_pkt_tx_retry);
+	init_waitqueue_head(&apm->tx_wait);
+	init_waitqueue_head(&apm->tx_idle);
+
+	xa_init_flags(&apm->audpkt_tokens, XA_FLAGS_ALLOC1);
+	xa_init_flags(&apm->streams, XA_FLAGS_ALLOC1);
+	INIT_DELAYED_WORK(&apm->token_reaper, audio_pkt_token_reaper);
+
+	apm->wq = alloc_workqueue("audio_pkt_%u", WQ_UNBOUND, 0, domain_id);
+	if (!apm->wq) {
+		ret = -ENOMEM;
+		goto free_dev;
+	}
+	INIT_WORK(&apm->recover, audio_pkt_recover);
+	spin_lock_init(&apm->state_lock);
+	init_waitqueue_head(&apm->state_wait);
+	INIT_WORK(&apm->state_uevent, audio_pkt_state_uevent);
 
 	cdev_init(&apm->cdev, &audio_pkt_fops);
 	apm->cdev.owner = THIS_MODULE;
 
-	ret = cdev_add(&apm->cdev, apm->audio_pkt_major,
-		       MINOR_NUMBER_COUNT);
+	ret = cdev_add(&apm->cdev, MKDEV(MAJOR(audio_pkt_devt), domain_id), 1);
 	if (ret) {
 		AUDIO_PKT_ERR("cdev_add failed for %s ret:%d\n",
 			      apm->dev_name, ret);
-		goto free_dev;
+		goto free_wq;
 	}
 
-	q6apm_audio_is_adsp_ready();
-	AUDIO_PKT_INFO("Audio Packet Port Driver Initialized\n");
-	return of_platform_populate(dev->of_node, NULL, NULL, dev);
+	return apm;
 
+free_wq:
+	destroy_workqueue(apm->wq);
 free_dev:
-	put_device(dev);
-	device_destroy(apm->audio_pkt_class, apm->audio_pkt_major);
-err_device:
-	class_destroy(apm->audio_pkt_class);
-err_class:
-	unregister_chrdev_region(MAJOR(apm->audio_pkt_major),
-				 MINOR_NUMBER_COUNT);
-err_chrdev:
-	return ret;
+	device_destroy(audio_pkt_class, MKDEV(MAJOR(audio_pkt_devt), domain_id));
+free_apm:
+	kfree(apm);
+	return ERR_PTR(ret);
+}
+
+static void audio_pkt_domain_destroy(struct q6apm_audio_pkt *apm)
+{
+	cdev_del(&apm->cdev);
+	cancel_work_sync(&apm->state_uevent);
+	device_destroy(audio_pkt_class, MKDEV(MAJOR(audio_pkt_devt), apm->domain_id));
+	/* Let closed files release what they own */
+	destroy_workqueue(apm->wq);
+	/* The releases sent commands, which armed these again */
+	cancel_delayed_work_sync(&apm->token_reaper);
+	cancel_delayed_work_sync(&apm->tx_retry);
+	xa_destroy(&apm->audpkt_tokens);
+	xa_destroy(&apm->streams);
+	kfree(apm);
+}
+
+static int q6apm_audio_pkt_probe(gpr_device_t *adev)
+{
+	struct device *dev = &adev->dev;
+	struct q6apm_audio_pkt *apm;
+	unsigned long flags;
+
+	if (adev->domain_id >= AUDIO_PKT_MAX_DOMAINS) {
+		dev_err(dev, "unsupported GPR domain %u\n", adev->domain_id);
+		return -EINVAL;
+	}
+
+	apm = audio_pkt_domains[adev->domain_id];
+	if (apm && apm->adev)
+		return -EBUSY;
+
+	if (!apm) {
+		apm = audio_pkt_domain_create(adev->domain_id);
+		if (IS_ERR(apm))
+			return PTR_ERR(apm);
+
+		dev_set_drvdata(dev, apm);
+		spin_lock_irqsave(&apm->tx_lock, flags);
+		apm->adev = adev;
+		apm->dsp_state = AUDIO_PKT_DSP_ONLINE;
+		spin_unlock_irqrestore(&apm->tx_lock, flags);
+		WRITE_ONCE(audio_pkt_domains[apm->domain_id], apm);
+		audio_pkt_state_changed(apm);
+		/* Learn when the APM is ready without holding up the probe */
+		queue_work(apm->wq, &apm->recover);
+	} else {
+		/* The DSP restarted, open files carry on once their maps are back */
+		dev_set_drvdata(dev, apm);
+		apm->restarts++;
+		spin_lock_irqsave(&apm->tx_lock, flags);
+		apm->adev = adev;
+		apm->dsp_state = AUDIO_PKT_DSP_RECOVERING;
+		spin_unlock_irqrestore(&apm->tx_lock, flags);
+		audio_pkt_state_changed(apm);
+		queue_work(apm->wq, &apm->recover);
+	}
+
+	AUDIO_PKT_INFO("Audio Packet Port Driver Initialized for %s\n", apm->dev_name);
+	return of_platform_populate(dev->of_node, NULL, NULL, dev);
+}
+
+/*
+ * Queue @skb to @client on the lane stored in skb->priority, or complete
+ * a pending io_uring receive with it. Readers are woken once a batch of
+ * coalesce max_pkts packets is queued or max_usecs after its first
+ * packet; high priority packets wake them at once.
+ */
+static void audio_pkt_client_deliver(struct audio_pkt_client *client,
+				     struct sk_buff *skb)
+{
+	struct audio_pkt_uring_req *ureq;
+	struct sk_buff_head dropped;
+	unsigned long flags;
+	bool wake = false;
+
+	__skb_queue_head_init(&dropped);
+
+	spin_lock_irqsave(&client->queue_lock, flags);
+	ureq = list_first_entry_or_null(&client->uring_recvq,
+					struct audio_pkt_uring_req, node);
+	if (ureq) {
+		list_del_init(&ureq->node);
+	} else if (!__audio_pkt_client_admit(client, skb, &dropped)) {
+		client->rx_dropped_pkts++;
+		client->rx_dropped_bytes += skb->len;
+		__skb_queue_tail(&dropped, skb);
+	} else {
+		__skb_queue_tail(&client->queue[skb->priority], skb);
+		client->rx_bytes += skb->len;
+		if (skb->priority == AUDIO_PKT_LANE_HIGH ||
+		    ++client->coalesce_pending >= client->coalesce.max_pkts) {
+			client->coalesce_pending = 0;
+			hrtimer_try_to_cancel(&client->coalesce_timer);
+			wake = true;
+		} else if (client->coalesce_pending == 1) {
+			hrtimer_start(&client->coalesce_timer,
+				      us_to_ktime(client->coalesce.max_usecs),
+				      HRTIMER_MODE_REL);
+		}
+	}
+	spin_unlock_irqrestore(&client->queue_lock, flags);
+
+	if (!skb_queue_empty(&dropped)) {
+		AUDIO_PKT_ERR("receive queue full, dropped %u packets\n",
+			      skb_queue_len(&dropped));
+		__skb_queue_purge(&dropped);
+	}
+
+	if (ureq)
+		audio_pkt_uring_complete(ureq, skb, 0);
+	else if (wake)
+		/* wake up any blocking processes, waiting for new data */
+		wake_up_interruptible(&client->readq);
+}
+
+static bool audio_pkt_filter_match(const u32 *list, u32 num, u32 val)
+{
+	u32 i;
+
+	if (!num)
+		return true;
+
+	for (i = 0; i < num; i++)
+		if (list[i] == val)
+			return true;
+
+	return false;
+}
+
+/* Whether @client subscribed to a packet that has no owning client */
+static bool audio_pkt_client_wants(struct audio_pkt_client *client,
+				   const struct gpr_hdr *hdr)
+{
+	struct audio_pkt_filter *filter;
+	bool wants = true;
+
+	/* Events of the driver itself reach every file */
+	if (GPR_OPCODE_CLASS(hdr->opcode) == GPR_OPCODE_CLASS_AUDIO_PKT_EVENT)
+		return true;
+
+	rcu_read_lock();
+	filter = rcu_dereference(client->filter);
+	if (filter)
+		wants = audio_pkt_filter_match(filter->opcodes, filter->num_opcodes,
+					       hdr->opcode) &&
+			audio_pkt_filter_match(filter->ports, filter->num_ports,
+					       hdr->src_port);
+	rcu_read_unlock();
+
+	return wants;
+}
+
+/* Hand a packet without an owning client to every subscribed open file */
+static void audio_pkt_broadcast(struct q6apm_audio_pkt *apm, struct sk_buff *skb)
+{
+	const struct gpr_hdr *hdr = (const struct gpr_hdr *)skb->data;
+	struct audio_pkt_client *client, *last = NULL;
+	struct sk_buff *clone;
+	unsigned long flags;
+
+	spin_lock_irqsave(&apm->clients_lock, flags);
+	list_for_each_entry(client, &apm->clients, node) {
+		if (!audio_pkt_client_wants(client, hdr))
+			continue;
+
+		if (last) {
+			clone = skb_clone(skb, GFP_ATOMIC);
+			if (clone)
+				audio_pkt_client_deliver(last, clone);
+		}
+		last = client;
+	}
+	if (last)
+		audio_pkt_client_deliver(last, skb);
+	else
+		kfree_skb(skb);
+	spin_unlock_irqrestore(&apm->clients_lock, flags);
+}
+
+static enum audio_pkt_lane audio_pkt_rx_lane(const struct gpr_resp_pkt *data)
+{
+	const struct gpr_ibasic_rsp_result_t *result = data->payload;
+	const struct gpr_hdr *hdr = &data->hdr;
+
+	if (GPR_OPCODE_CLASS(hdr->opcode) == GPR_OPCODE_CLASS_DATA_RSP)
+		return AUDIO_PKT_LANE_HIGH;
+
+	/* Acknowledgement of a data path command */
+	if (hdr->opcode == GPR_BASIC_RSP_RESULT &&
+	    data->payload_size >= sizeof(*result) &&
+	    GPR_OPCODE_CLASS(result->opcode) == GPR_OPCODE_CLASS_DATA_CMD)
+		return AUDIO_PKT_LANE_HIGH;
+
+	return AUDIO_PKT_LANE_LOW;
+}
+
+/* Put the handle @client was given back into a buffer done response */
+static void audio_pkt_rsp_user_handle(struct audio_pkt_client *client, struct sk_buff *skb)
+{
+	const struct gpr_hdr *hdr = (const struct gpr_hdr *)skb->data;
+	size_t off = hdr->hdr_size * 4;
+	u32 *handle;
+
+	switch (hdr->opcode) {
+	case DATA_CMD_RSP_WR_SH_MEM_EP_DATA_BUFFER_DONE_V2:
+		off += offsetof(struct data_cmd_rsp_wr_sh_mem_ep_data_buffer_done_v2,
+				mem_map_handle);
+		break;
+	case DATA_CMD_RSP_RD_SH_MEM_EP_DATA_BUFFER_DONE_V2:
+		off += offsetof(struct data_cmd_rsp_rd_sh_mem_ep_data_buffer_done_v2,
+				mem_map_handle);
+		break;
+	default:
+		return;
+	}
+
+	if (off + sizeof(u32) > skb->len)
+		return;
+
+	handle = (u32 *)(skb->data + off);
+	audio_pkt_client_user_handle(client, *handle, handle);
+}
+
+/*
+ * Take the route of the packet @data, which answers the command of its
+ * token. Lock free lookup; the entry is only claimed, under the xarray
+ * spinlock, when the token is actually outstanding. A persistent entry
+ * stays for the packets to come, without the waiter the first one went
+ * to, until a failed acknowledgement or the EOS rendered report. Called
+ * under RCU; @route holds a reference to its client.
+ */
+static bool audio_pkt_take_route(struct q6apm_audio_pkt *apm,
+				 const struct gpr_resp_pkt *data,
+				 struct gpr_port_map *route)
+{
+	const struct gpr_ibasic_rsp_result_t *result = data->payload;
+	struct gpr_port_map *audpkt_port_map, *next = NULL;
+	u32 token = data->hdr.token;
+	bool last;
+
+	audpkt_port_map = xa_load(&apm->audpkt_tokens, token);
+	if (!audpkt_port_map)
+		return false;
+
+	last = !audpkt_port_map->persistent ||
+	       data->hdr.opcode == DATA_CMD_RSP_WR_SH_MEM_EP_EOS_RENDERED ||
+	       (data->hdr.opcode == GPR_BASIC_RSP_RESULT &&
+		data->payload_size >= sizeof(*result) && result->status);
+	if (!last && !audpkt_port_map->answered) {
+		next = kmemdup(audpkt_port_map, sizeof(*next), GFP_ATOMIC);
+		last = !next;
+	}
+
+	xa_lock(&apm->audpkt_tokens);
+	if (xa_load(&apm->audpkt_tokens, token) != audpkt_port_map) {
+		xa_unlock(&apm->audpkt_tokens);
+		kfree(next);
+		return false;
+	}
+
+	*route = *audpkt_port_map;
+	if (last) {
+		__xa_erase(&apm->audpkt_tokens, token);
+		kfree_rcu(audpkt_port_map, rcu);
+	} else if (next) {
+		next->ureq = NULL;
+		next->txn = NULL;
+		next->answered = true;
+		kref_get(&next->client->refcount);
+		__xa_store(&apm->audpkt_tokens, token, next, 0);
+		kfree_rcu(audpkt_port_map, rcu);
+	} else {
+		/* Present under the lock, so its client reference holds */
+		kref_get(&route->client->refcount);
+	}
+	xa_unlock(&apm->audpkt_tokens);
+
+	return true;
 }
 
 static int q6apm_audio_pkt_callback(struct gpr_resp_pkt *data, void *priv, int op)
 {
 	gpr_device_t *gdev = priv;
 	struct q6apm_audio_pkt *apm = dev_get_drvdata(&gdev->dev);
-	struct gpr_ibasic_rsp_result_t *result;
 	struct gpr_hdr *hdr = &data->hdr;
-	uint8_t *pkt = NULL;
+	struct gpr_port_map route = { .client = NULL };
 	uint16_t hdr_size, pkt_size;
-	unsigned long flags;
 	struct sk_buff *skb;
-	int ret;
-	struct gpr_port_map *audpkt_port_map;
+	struct audio_pkt_mem_map *map;
+	u32 token = hdr->token;
+	u32 handle;
+	int ret = 0;
 
 
         hdr_size = hdr->hdr_size * 4;
         pkt_size = hdr->pkt_size;
 
-	mutex_lock(&apm->audpkt_port_lock);
-	audpkt_port_map = idr_find(&apm->audpkt_port_idr, hdr->token);
-	if (audpkt_port_map) {
-		hdr->dest_port = audpkt_port_map->src_port;
-		hdr->src_port = audpkt_port_map->dst_port;
+	/* Stream buffers are recycled in the kernel, userspace never sees them */
+	if (hdr->token & AUDIO_PKT_STREAM_TOKEN) {
+		audio_pkt_stream_done(apm, data);
+		return 0;
+	}
 
-		idr_remove(&apm->audpkt_port_idr, hdr->token);
-		kfree(audpkt_port_map);
+	/* Any answer to APM_CMD_GET_SPF_STATE refreshes the cached readiness */
+	if (hdr->opcode == APM_CMD_RSP_GET_SPF_STATE && pkt_size - hdr_size >= sizeof(u32))
+		audio_pkt_set_spf_ready(apm, *(u32 *)data->payload != 0);
+
+	rcu_read_lock();
+	if (audio_pkt_take_route(apm, data, &route)) {
+		hdr->dest_port = route.src_port;
+		hdr->src_port = route.dst_port;
+		hdr->token = route.user_token;
 	} else {
 		AUDIO_PKT_ERR("Token=%u not found\n", hdr->token);
 	}
-	mutex_unlock(&apm->audpkt_port_lock);
+	rcu_read_unlock();
+
+	skb = alloc_skb(pkt_size, GFP_ATOMIC);
+	if (!skb) {
+		if (route.ureq)
+			audio_pkt_uring_complete(route.ureq, NULL, -ENOMEM);
+		if (route.txn) {
+			route.txn->status = -ENOMEM;
+			complete(&route.txn->done);
+		}
+		ret = -ENOMEM;
+		goto put_client;
+	}
 
-        pkt = kmalloc(pkt_size, GFP_KERNEL);
-        if (!pkt)
-                return -ENOMEM;
+	skb_put_data(skb, (uint8_t *)data, hdr_size);
+	skb_put_data(skb, (uint8_t *)data->payload, pkt_size - hdr_size);
+	skb->priority = audio_pkt_rx_lane(data);
+
+	/*
+	 * The map is the client's to release, should it close without
+	 * unmapping. The client gets a handle of its own, which a handle the
+	 * DSP hands out after a restart cannot collide with.
+	 */
+	if (route.client && route.opcode == APM_CMD_SHARED_MEM_MAP_REGIONS) {
+		map = xa_erase(&route.client->pending_maps, token);
+		if (map && hdr->opcode == APM_CMD_RSP_SHARED_MEM_MAP_REGIONS &&
+		    data->payload_size >= sizeof(u32)) {
+			map->dsp_handle = *(u32 *)data->payload;
+			if (xa_alloc(&route.client->owned_maps, &handle, map,
+				     XA_LIMIT(1, U32_MAX), GFP_ATOMIC) < 0) {
+				AUDIO_PKT_ERR("no handle for memory map %u\n", map->dsp_handle);
+				audio_pkt_mem_map_free(map);
+			} else {
+				*(u32 *)(skb->data + hdr_size) = handle;
+			}
+		} else {
+			audio_pkt_mem_map_free(map);
+		}
+	}
 
-        memcpy(pkt, (uint8_t *)data, hdr_size);
-        memcpy(pkt + hdr_size, (uint8_t *)data->payload, pkt_size - hdr_size);
+	/* Buffers come back with the handle the DSP knows, not the client's */
+	if (route.client) {
+		audio_pkt_client_commit_track(route.client, token, data);
+		audio_pkt_rsp_user_handle(route.client, skb);
+	}
 
-        skb = alloc_skb(pkt_size, GFP_ATOMIC);
-        if (!skb)
-                return -ENOMEM;
+	/* Responses with a waiter go straight to it, one wake-up per response */
+	if (route.ureq) {
+		audio_pkt_uring_complete(route.ureq, skb, 0);
+	} else if (route.txn) {
+		route.txn->skb = skb;
+		complete(&route.txn->done);
+	} else if (route.client) {
+		audio_pkt_client_deliver(route.client, skb);
+	} else {
+		audio_pkt_broadcast(apm, skb);
+	}
 
-        skb_put_data(skb, (void *)pkt, pkt_size);
+put_client:
+	if (route.client)
+		audio_pkt_client_put(route.client);
 
-        kfree(pkt);
-        spin_lock_irqsave(&apm->queue_lock, flags);
-        skb_queue_tail(&apm->queue, skb);
-        spin_unlock_irqrestore(&apm->queue_lock, flags);
+	return ret;
+}
 
+/*
+ * Tell every open file that the DSP went down or came back. The event is
+ * a GPR packet from the APM whose payload is the restart count, queued on
+ * the high priority lane whatever the filter of the file.
+ */
+static void audio_pkt_broadcast_event(struct q6apm_audio_pkt *apm, u32 opcode)
+{
+	struct gpr_hdr *hdr;
+	struct sk_buff *skb;
 
-	/* wake up any blocking processes, waiting for new data */
-	wake_up_interruptible(&apm->readq);
-	if(hdr->opcode == APM_CMD_RSP_GET_SPF_STATE) {
-                 result = data->payload;
-                 apm->result.opcode = hdr->opcode;
-                 apm->result.status = 0;
-                 /* First word of result it state */
-                 apm->state = hdr->opcode;
-     }
+	skb = alloc_skb(GPR_HDR_SIZE + sizeof(u32), GFP_KERNEL);
+	if (!skb)
+		return;
 
-	return 0;
+	hdr = skb_put_zero(skb, GPR_HDR_SIZE);
+	hdr->version = GPR_PKT_VER;
+	hdr->hdr_size = GPR_PKT_HEADER_WORD_SIZE;
+	hdr->pkt_size = GPR_HDR_SIZE + sizeof(u32);
+	hdr->src_domain = apm->domain_id;
+	hdr->dest_domain = GPR_DOMAIN_ID_APPS;
+	hdr->src_port = APM_MODULE_INSTANCE_ID;
+	hdr->opcode = opcode;
+	skb_put_data(skb, &apm->restarts, sizeof(u32));
+	skb->priority = AUDIO_PKT_LANE_HIGH;
+
+	audio_pkt_broadcast(apm, skb);
 }
 
+/* Complete every command still waiting for the DSP with @err */
+static void audio_pkt_fail_tokens(struct q6apm_audio_pkt *apm, int err)
+{
+	struct gpr_port_map *audpkt_port_map;
+	unsigned long id;
+
+	rcu_read_lock();
+	xa_for_each(&apm->audpkt_tokens, id, audpkt_port_map) {
+		if (xa_cmpxchg(&apm->audpkt_tokens, id, audpkt_port_map,
+			       NULL, 0) != audpkt_port_map)
+			continue;
+
+		if (audpkt_port_map->ureq)
+			audio_pkt_uring_complete(audpkt_port_map->ureq, NULL, err);
+		if (audpkt_port_map->txn) {
+			audpkt_port_map->txn->status = err;
+			complete(&audpkt_port_map->txn->done);
+		}
+		audio_pkt_client_drop_pending(audpkt_port_map->client, id);
+		audio_pkt_client_put(audpkt_port_map->client);
+		kfree_rcu(audpkt_port_map, rcu);
+	}
+	rcu_read_unlock();
+}
+
+/* The DSP lost its graphs, none is left for the teardown to close */
+static void audio_pkt_forget_graphs(struct q6apm_audio_pkt *apm)
+{
+	struct audio_pkt_client *client;
+	unsigned long flags;
+
+	spin_lock_irqsave(&apm->clients_lock, flags);
+	list_for_each_entry(client, &apm->clients, node)
+		xa_destroy(&client->owned_graphs);
+	spin_unlock_irqrestore(&apm->clients_lock, flags);
+}
+
+/*
+ * Rebuild the memory map command of @map from the buffers it holds, not
+ * from the fd numbers it was sent with: by now those may name another
+ * process's buffers. Called under RCU.
+ */
+static struct gpr_pkt *audio_pkt_mem_map_rebuild(const struct audio_pkt_mem_map *map)
+{
+	struct audio_pkt_apm_shared_map_region_payload_t *region;
+	struct gpr_hdr *hdr;
+	dma_addr_t paddr;
+	size_t pa_len;
+	unsigned int i;
+	void *payload;
+	bool lsw_is_fd;
+
+	/* Sending rewrites the packet, the saved one must stay as sent */
+	hdr = kmemdup(map->cmd, map->len, GFP_ATOMIC);
+	if (!hdr)
+		return NULL;
+
+	payload = (void *)hdr + hdr->hdr_size * 4;
+	lsw_is_fd = audio_pkt_mem_map_lsw_is_fd(payload);
+	region = payload + sizeof(struct audio_pkt_apm_cmd_shared_mem_map_regions_t);
+	for (i = 0; i < map->num_bufs; i++, region++) {
+		if (!map->bufs[i])
+			continue;
+
+		msm_audio_mem_buf_addr(map->bufs[i], &paddr, &pa_len);
+		if (!lsw_is_fd)
+			paddr += region->shm_addr_lsw;
+		region->shm_addr_lsw = lower_32_bits(paddr);
+		region->shm_addr_msw = upper_32_bits(paddr);
+	}
+
+	return (struct gpr_pkt *)hdr;
+}
+
+/* Map the memory of @client to the DSP again, under the handles it knows */
+static void audio_pkt_client_restore_maps(struct q6apm_audio_pkt *apm,
+					  struct audio_pkt_client *client)
+{
+	struct audio_pkt_mem_map *map;
+	struct gpr_pkt *pkt;
+	unsigned long handle;
+	u32 dsp_handle;
+	int ret;
+
+	/* An unmap response may free a map meanwhile, look it up again */
+	mutex_lock(&client->maps_lock);
+	rcu_read_lock();
+	xa_for_each(&client->owned_maps, handle, map) {
+		pkt = audio_pkt_mem_map_rebuild(map);
+		if (!pkt)
+			break;
+		rcu_read_unlock();
+
+		dsp_handle = 0;
+		ret = q6apm_audio_send_cmd(apm, pkt, AUDIO_PKT_SEND_WAIT_TIMEOUT_MS,
+					   &dsp_handle);
+		kfree(pkt);
+		rcu_read_lock();
+		if (ret < 0 || !dsp_handle) {
+			AUDIO_PKT_ERR("restoring memory map %lu failed ret %d\n", handle, ret);
+			continue;
+		}
+
+		map = xa_load(&client->owned_maps, handle);
+		if (map)
+			WRITE_ONCE(map->dsp_handle, dsp_handle);
+	}
+	rcu_read_unlock();
+	mutex_unlock(&client->maps_lock);
+}
+
+/**
+ * audio_pkt_recover() - Restore the open files after a DSP restart
+ * work:	recover work of the device.
+ *
+ * Waits for the APM to report ready, which is all there is to do after
+ * the first probe. After a restart the buffers handed to the ADSP are
+ * assigned to it again and the memory maps of every open file are
+ * replayed; files keep their old handles, translated on the way out.
+ * Graphs are for userspace to open again once it reads
+ * AUDIO_PKT_EVENT_DSP_UP.
+ */
+static void audio_pkt_recover(struct work_struct *work)
+{
+	struct q6apm_audio_pkt *apm = container_of(work, struct q6apm_audio_pkt, recover);
+	struct audio_pkt_client *client, **clients;
+	unsigned int num = 0, i = 0;
+	unsigned long flags;
+	bool up = false;
+
+	if (!audio_pkt_poll_spf_ready(apm) ||
+	    READ_ONCE(apm->dsp_state) != AUDIO_PKT_DSP_RECOVERING)
+		return;
+
+	if (apm->domain_id == GPR_DOMAIN_ID_ADSP)
+		msm_audio_mem_ssr_reassign();
+
+	spin_lock_irqsave(&apm->clients_lock, flags);
+	list_for_each_entry(client, &apm->clients, node)
+		num++;
+	spin_unlock_irqrestore(&apm->clients_lock, flags);
+
+	clients = kcalloc(num, sizeof(*clients), GFP_KERNEL);
+	if (clients) {
+		spin_lock_irqsave(&apm->clients_lock, flags);
+		list_for_each_entry(client, &apm->clients, node) {
+			if (i == num)
+				break;
+			kref_get(&client->refcount);
+			clients[i++] = client;
+		}
+		spin_unlock_irqrestore(&apm->clients_lock, flags);
+
+		for (num = i, i = 0; i < num; i++) {
+			audio_pkt_client_restore_maps(apm, clients[i]);
+			audio_pkt_client_put(clients[i]);
+		}
+		kfree(clients);
+	}
+
+	spin_lock_irqsave(&apm->tx_lock, flags);
+	if (apm->dsp_state == AUDIO_PKT_DSP_RECOVERING) {
+		apm->dsp_state = AUDIO_PKT_DSP_ONLINE;
+		up = true;
+	}
+	spin_unlock_irqrestore(&apm->tx_lock, flags);
+
+	if (up) {
+		AUDIO_PKT_INFO("%s recovered from restart %u\n", apm->dev_name, apm->restarts);
+		audio_pkt_state_changed(apm);
+		audio_pkt_broadcast_event(apm, AUDIO_PKT_EVENT_DSP_UP);
+	}
+}
+
+/*
+ * The GPR device goes away when the DSP crashes or shuts down. Everything
+ * in flight fails with -ENETRESET at once rather than on timeout, and the
+ * char device stays, for the files to carry on when the DSP comes back.
+ */
 static void q6apm_audio_pkt_remove(gpr_device_t *adev)
 {
+	struct q6apm_audio_pkt *apm = dev_get_drvdata(&adev->dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&apm->tx_lock, flags);
+	apm->dsp_state = AUDIO_PKT_DSP_OFFLINE;
+	spin_unlock_irqrestore(&apm->tx_lock, flags);
+	audio_pkt_set_spf_ready(apm, false);
+	audio_pkt_state_changed(apm);
+
+	cancel_delayed_work_sync(&apm->tx_retry);
+	/* A sender may still be in gpr_send_pkt(), it must be done with adev */
+	wait_event(apm->tx_idle, !READ_ONCE(apm->tx_draining));
+	audio_pkt_tx_drain(apm, true);
+	audio_pkt_fail_tokens(apm, -ENETRESET);
+	cancel_work_sync(&apm->recover);
+	audio_pkt_fail_streams(apm, -ENETRESET);
+	audio_pkt_forget_graphs(apm);
+	audio_pkt_broadcast_event(apm, AUDIO_PKT_EVENT_DSP_DOWN);
+
+	cancel_delayed_work_sync(&apm->token_reaper);
 	of_platform_depopulate(&adev->dev);
+	spin_lock_irqsave(&apm->tx_lock, flags);
+	apm->adev = NULL;
+	spin_unlock_irqrestore(&apm->tx_lock, flags);
 }
 
 #ifdef CONFIG_OF
@@ -687,13 +4523,50 @@ static gpr_driver_t apm_driver = {
 //module_gpr_driver(apm_driver);
 int q6apm_audio_pkt_init(void)
 {
-	    return apr_driver_register(&apm_driver);;//gpr_driver_register(&apm_driver);
+	int ret;
+
+	ret = alloc_chrdev_region(&audio_pkt_devt, 0, AUDIO_PKT_MAX_DOMAINS,
+				  AUDPKT_DRIVER_NAME);
+	if (ret < 0) {
+		pr_err("alloc_chrdev_region failed ret:%d\n", ret);
+		return ret;
+	}
+
+	audio_pkt_class = class_create(AUDPKT_DRIVER_NAME);
+	if (IS_ERR(audio_pkt_class)) {
+		ret = PTR_ERR(audio_pkt_class);
+		pr_err("class_create failed ret:%d\n", ret);
+		goto err_class;
+	}
+
+	ret = apr_driver_register(&apm_driver);//gpr_driver_register(&apm_driver);
+	if (ret)
+		goto err_driver;
+
+	return 0;
+
+err_driver:
+	class_destroy(audio_pkt_class);
+err_class:
+	unregister_chrdev_region(audio_pkt_devt, AUDIO_PKT_MAX_DOMAINS);
+	return ret;
 }
 
 void q6apm_audio_pkt_exit(void)
 {
+	int domain_id;
+
 	apr_driver_unregister(&apm_driver);
 //	    gpr_driver_unregister(&apm_driver);
+	for (domain_id = 0; domain_id < AUDIO_PKT_MAX_DOMAINS; domain_id++) {
+		if (audio_pkt_domains[domain_id])
+			audio_pkt_domain_destroy(audio_pkt_domains[domain_id]);
+		audio_pkt_domains[domain_id] = NULL;
+	}
+	/* Memory maps hand their buffers back from RCU callbacks */
+	rcu_barrier();
+	class_destroy(audio_pkt_class);
+	unregister_chrdev_region(audio_pkt_devt, AUDIO_PKT_MAX_DOMAINS);
 }
 MODULE_DESCRIPTION("Audio Process Manager");
 MODULE_LICENSE("GPL");
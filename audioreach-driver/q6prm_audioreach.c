@@ -33,6 +33,12 @@ struct q6prm {
 #define PARAM_ID_RSC_HW_CORE		0x08001032
 #define PARAM_ID_RSC_LPASS_CORE		0x0800102B
 #define PARAM_ID_RSC_AUDIO_HW_CLK	0x0800102C
+/*
+ * Bounds the wait for the APM in probe, deferred after that. As long as
+ * the APM state query used to wait for its answer: nothing but another
+ * driver binding retries a deferred probe.
+ */
+#define PRM_ADSP_READY_WAIT_MS		2000
 
 struct prm_cmd_request_hw_core {
 	struct apm_module_param_data param_data;
@@ -314,8 +320,8 @@ static int prm_audioreach_probe(gpr_device_t *gdev)
 	init_waitqueue_head(&cc->wait);
 	dev_set_drvdata(dev, cc);
 
-	if (!q6apm_audio_is_adsp_ready()) {
-		pr_err("DEBUG:%s:%d: failed\n",__func__,__LINE__);
+	if (q6apm_audio_wait_adsp_ready(PRM_ADSP_READY_WAIT_MS)) {
+		dev_dbg(dev, "ADSP not ready, deferring\n");
 		return -EPROBE_DEFER;
 	}
 
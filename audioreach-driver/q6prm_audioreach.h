@@ -15,8 +15,15 @@ int q6prm_audioreach_unvote_lpass_core_hw(struct device *dev, uint32_t hw_block_
 			       uint32_t client_handle);
 
 bool q6apm_audio_is_adsp_ready(void);
+int q6apm_audio_wait_adsp_ready(unsigned int timeout_ms);
 int msm_audio_get_phy_addr(int fd, dma_addr_t *paddr, size_t *pa_len);
 void msm_audio_mem_crash_handler(void);
+void *msm_audio_mem_get_buf(int fd, dma_addr_t *paddr, size_t *pa_len);
+void msm_audio_mem_buf_addr(void *buf, dma_addr_t *paddr, size_t *pa_len);
+void msm_audio_mem_hold_buf(void *buf);
+int msm_audio_mem_read_buf(void *buf, size_t offset, void *dst, size_t len);
+void msm_audio_mem_put_buf(void *buf);
+void msm_audio_mem_ssr_reassign(void);
 
 int q6apm_audio_mem_init(void);
 void q6apm_audio_mem_exit(void);
@@ -10,8 +10,11 @@
 #include <linux/of.h>
 #include <linux/of_platform.h>
 #include <linux/jiffies.h>
+#include <linux/notifier.h>
+#include <linux/workqueue.h>
 #include <linux/soc/qcom/apr.h>
 #include <dt-bindings/soc/qcom,gpr.h>
+#include <dsp/spf-core.h>
 
 #define APM_STATE_READY_TIMEOUT_MS    10000
 #define Q6_READY_TIMEOUT_MS 1000
@@ -28,12 +31,26 @@ struct spf_core {
 	bool is_ready;
 };
 
+enum spf_core_state {
+	SPF_CORE_OFFLINE,	/* no GPR device, the DSP is down */
+	SPF_CORE_BOOTING,	/* querying the APM until it reports ready */
+	SPF_CORE_READY,
+};
+
 struct spf_core_private {
 	struct device *dev;
 	struct mutex lock;
 	struct spf_core *spf_core_drv;
 	bool is_initial_boot;
-	struct work_struct add_chld_dev_work;
+	/* Written under lock, waiters are woken on every change */
+	enum spf_core_state state;
+	wait_queue_head_t state_wait;
+	struct blocking_notifier_head nh;
+	/* Queries the APM with the spf_ready_poll_next_ms() backoff */
+	struct delayed_work ready_work;
+	unsigned int poll_ms;
+	unsigned long poll_warn;
+	bool poll_warned;
 };
 
 static struct spf_core_private *spf_core_priv;
@@ -65,7 +82,7 @@ static int spf_core_callback(struct gpr_resp_pkt *data, void *priv, int op)
 		break;
 	case APM_CMD_RSP_GET_SPF_STATE:
 		core->is_ready = result->opcode;
-		dev_err(&gdev->dev, "%s: success response received, core->is_ready=%d\n",
+		dev_dbg(&gdev->dev, "%s: success response received, core->is_ready=%d\n",
 				__func__, core->is_ready);
 		core->resp_received = true;
 		break;
@@ -117,42 +134,148 @@ static bool __spf_core_is_apm_ready(struct spf_core *core)
 	return false;
 }
 
+/* Caller holds spf_core_priv->lock */
+static void spf_core_start_polling(void)
+{
+	spf_core_priv->poll_ms = SPF_READY_POLL_MIN_MS;
+	spf_core_priv->poll_warn = jiffies + msecs_to_jiffies(SPF_READY_WARN_MS);
+	spf_core_priv->poll_warned = false;
+	mod_delayed_work(system_wq, &spf_core_priv->ready_work, 0);
+}
+
+/**
+ * spf_core_wait_apm_ready() - Wait for the apm to be ready
+ * timeout_ms:	how long to wait, in milliseconds.
+ *
+ * Sleeps until the readiness state machine sees the apm ready; the
+ * callers share its queries rather than issuing their own.
+ *
+ * Return: 0 once the apm is ready, -ETIMEDOUT or -ENODEV otherwise.
+ */
+int spf_core_wait_apm_ready(unsigned int timeout_ms)
+{
+	if (!spf_core_priv)
+		return -ENODEV;
+
+	if (!wait_event_timeout(spf_core_priv->state_wait,
+				READ_ONCE(spf_core_priv->state) == SPF_CORE_READY,
+				msecs_to_jiffies(timeout_ms)))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(spf_core_wait_apm_ready);
+
 /**
  * spf_core_is_apm_ready() - Get status of adsp
  *
+ * Waits up to APM_STATE_READY_TIMEOUT_MS while the apm boots.
+ *
  * Return: Will be an true if apm is ready and false if not.
  */
 bool spf_core_is_apm_ready(void)
 {
-	unsigned long  timeout;
-	bool ret = false;
-	struct spf_core *core;
+	if (!spf_core_priv || READ_ONCE(spf_core_priv->state) == SPF_CORE_OFFLINE)
+		return false;
+
+	return !spf_core_wait_apm_ready(APM_STATE_READY_TIMEOUT_MS);
+}
+EXPORT_SYMBOL_GPL(spf_core_is_apm_ready);
+
+/**
+ * spf_core_register_notifier() - Get told of apm state changes
+ * nb:	notifier called with SPF_CORE_APM_READY or SPF_CORE_APM_DOWN.
+ *
+ * Return: 0 on success, -ENODEV before the platform probe.
+ */
+int spf_core_register_notifier(struct notifier_block *nb)
+{
+	if (!spf_core_priv)
+		return -ENODEV;
+
+	return blocking_notifier_chain_register(&spf_core_priv->nh, nb);
+}
+EXPORT_SYMBOL_GPL(spf_core_register_notifier);
 
+int spf_core_unregister_notifier(struct notifier_block *nb)
+{
 	if (!spf_core_priv)
-		return ret;
+		return -ENODEV;
+
+	return blocking_notifier_chain_unregister(&spf_core_priv->nh, nb);
+}
+EXPORT_SYMBOL_GPL(spf_core_unregister_notifier);
+
+/* Tell waiters and the notifier chain of a state change, without the lock */
+static void spf_core_notify(unsigned long event)
+{
+	wake_up_all(&spf_core_priv->state_wait);
+	blocking_notifier_call_chain(&spf_core_priv->nh, event, NULL);
+}
+
+static void spf_core_add_child_devices(void)
+{
+	int ret;
+
+	ret = of_platform_populate(spf_core_priv->dev->of_node,
+			NULL, NULL, spf_core_priv->dev);
+	if (ret)
+		dev_err(spf_core_priv->dev, "%s: failed to add child nodes, ret=%d\n",
+			__func__, ret);
+
+	spf_core_priv->is_initial_boot = false;
+}
 
+/*
+ * One apm state query per run, requeued with a doubling delay. The core
+ * lock is held for the query only, never across the backoff, and waiters
+ * never take it. spf_core_exit() cancels the work before freeing core.
+ */
+static void spf_core_ready_work(struct work_struct *work)
+{
+	struct spf_core *core;
+	bool ready;
+
+	mutex_lock(&spf_core_priv->lock);
 	core = spf_core_priv->spf_core_drv;
-	if (!core)
-		return ret;
+	if (!core || spf_core_priv->state != SPF_CORE_BOOTING) {
+		mutex_unlock(&spf_core_priv->lock);
+		return;
+	}
+	mutex_unlock(&spf_core_priv->lock);
 
 	mutex_lock(&core->lock);
-	timeout = jiffies + msecs_to_jiffies(APM_STATE_READY_TIMEOUT_MS);
-	for (;;) {
-		if (__spf_core_is_apm_ready(core)) {
-			ret = true;
-			break;
-		}
-		usleep_range(300000, 300050);
-		if (!time_after(timeout, jiffies)) {
-			ret = false;
-			break;
+	ready = __spf_core_is_apm_ready(core);
+	mutex_unlock(&core->lock);
+
+	mutex_lock(&spf_core_priv->lock);
+	if (spf_core_priv->state != SPF_CORE_BOOTING) {
+		mutex_unlock(&spf_core_priv->lock);
+		return;
+	}
+
+	if (!ready) {
+		if (!spf_core_priv->poll_warned &&
+		    time_after(jiffies, spf_core_priv->poll_warn)) {
+			dev_warn(spf_core_priv->dev, "%s: apm not up after %u ms, still polling\n",
+				 __func__, SPF_READY_WARN_MS);
+			spf_core_priv->poll_warned = true;
 		}
+		schedule_delayed_work(&spf_core_priv->ready_work,
+				      msecs_to_jiffies(spf_core_priv->poll_ms));
+		spf_core_priv->poll_ms = spf_ready_poll_next_ms(spf_core_priv->poll_ms);
+		mutex_unlock(&spf_core_priv->lock);
+		return;
 	}
+	WRITE_ONCE(spf_core_priv->state, SPF_CORE_READY);
+	mutex_unlock(&spf_core_priv->lock);
 
-	mutex_unlock(&core->lock);
-	return ret;
+	dev_dbg(spf_core_priv->dev, "%s: apm is up\n", __func__);
+	spf_core_notify(SPF_CORE_APM_READY);
+
+	if (spf_core_priv->is_initial_boot)
+		spf_core_add_child_devices();
 }
-EXPORT_SYMBOL_GPL(spf_core_is_apm_ready);
 
 static int spf_core_probe(gpr_device_t *adev)
 {
@@ -174,8 +297,8 @@ static int spf_core_probe(gpr_device_t *adev)
 	core->adev = adev;
 	init_waitqueue_head(&core->wait);
 	spf_core_priv->spf_core_drv = core;
-	if (spf_core_priv->is_initial_boot)
-		schedule_work(&spf_core_priv->add_chld_dev_work);
+	WRITE_ONCE(spf_core_priv->state, SPF_CORE_BOOTING);
+	spf_core_start_polling();
 	mutex_unlock(&spf_core_priv->lock);
 
 	return 0;
@@ -189,6 +312,13 @@ static void spf_core_exit(gpr_device_t *adev)
 		pr_err("%s: spf_core platform probe not yet done\n", __func__);
 		return;
 	}
+	mutex_lock(&spf_core_priv->lock);
+	WRITE_ONCE(spf_core_priv->state, SPF_CORE_OFFLINE);
+	mutex_unlock(&spf_core_priv->lock);
+	/* A query in progress finds the state changed and stops */
+	cancel_delayed_work_sync(&spf_core_priv->ready_work);
+	spf_core_notify(SPF_CORE_APM_DOWN);
+
 	mutex_lock(&spf_core_priv->lock);
 	spf_core_priv->spf_core_drv = NULL;
 	kfree(core);
@@ -211,28 +341,6 @@ static gpr_driver_t ar_spf_core_driver = {
 	},
 };
 
-static void spf_core_add_child_devices(struct work_struct *work)
-{
-	int ret;
-
-	if (spf_core_is_apm_ready()) {
-		dev_err(spf_core_priv->dev, "%s: apm is up\n",
-			__func__);
-	} else {
-		dev_err(spf_core_priv->dev, "%s: apm is not up\n",
-			__func__);
-		return;
-	}
-
-	ret = of_platform_populate(spf_core_priv->dev->of_node,
-			NULL, NULL, spf_core_priv->dev);
-	if (ret)
-		dev_err(spf_core_priv->dev, "%s: failed to add child nodes, ret=%d\n",
-			__func__, ret);
-
-	spf_core_priv->is_initial_boot = false;
-}
-
 static int spf_core_platform_driver_probe(struct platform_device *pdev)
 {
 	int ret = 0;
@@ -245,7 +353,9 @@ static int spf_core_platform_driver_probe(struct platform_device *pdev)
 
 	mutex_init(&spf_core_priv->lock);
 
-	INIT_WORK(&spf_core_priv->add_chld_dev_work, spf_core_add_child_devices);
+	init_waitqueue_head(&spf_core_priv->state_wait);
+	BLOCKING_INIT_NOTIFIER_HEAD(&spf_core_priv->nh);
+	INIT_DELAYED_WORK(&spf_core_priv->ready_work, spf_core_ready_work);
 
 	spf_core_priv->is_initial_boot = true;
 	ret = apr_driver_register(&ar_spf_core_driver);
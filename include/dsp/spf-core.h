@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright (c) 2023-2024 Qualcomm Innovation Center, Inc. All rights reserved.
+ */
+
+#ifndef _SPF_CORE_H
+#define _SPF_CORE_H
+
+#include <linux/minmax.h>
+#include <linux/notifier.h>
+
+/* Events of the spf core notifier chain */
+#define SPF_CORE_APM_READY	1
+#define SPF_CORE_APM_DOWN	2
+
+/*
+ * Backoff between APM state queries while the DSP boots. The delay
+ * doubles up to SPF_READY_POLL_MAX_MS and stays there until the APM is
+ * ready or the DSP goes offline; nothing else would query it again. A
+ * DSP still booting after SPF_READY_WARN_MS is reported once.
+ */
+#define SPF_READY_POLL_MIN_MS	2
+#define SPF_READY_POLL_MAX_MS	256
+#define SPF_READY_WARN_MS	10000
+
+static inline unsigned int spf_ready_poll_next_ms(unsigned int delay_ms)
+{
+	return min_t(unsigned int, delay_ms * 2, SPF_READY_POLL_MAX_MS);
+}
+
+bool spf_core_is_apm_ready(void);
+int spf_core_wait_apm_ready(unsigned int timeout_ms);
+int spf_core_register_notifier(struct notifier_block *nb);
+int spf_core_unregister_notifier(struct notifier_block *nb);
+#endif /* _SPF_CORE_H */
@@ -28,4 +28,381 @@
 #define IOCTL_MAP_HYP_ASSIGN _IOW(AUDIO_IOCTL_MAGIC, 99, int)
 #define IOCTL_UNMAP_HYP_ASSIGN _IOW(AUDIO_IOCTL_MAGIC, 100, int)
 
+/*
+ * Largest GPR packet the transport carries. A write() to an audio pkt
+ * device holds at most AUDIO_PKT_MAX_WRITE_PKTS such packets framed back
+ * to back; longer writes fail with EINVAL.
+ */
+#define AUDIO_PKT_MAX_PKT_SIZE		8192
+#define AUDIO_PKT_MAX_WRITE_PKTS	16
+#define AUDIO_PKT_MAX_WRITE_SIZE	(AUDIO_PKT_MAX_WRITE_PKTS * AUDIO_PKT_MAX_PKT_SIZE)
+
+/**
+ * struct audio_pkt_send_wait - AUDIO_PKT_IOCTL_SEND_WAIT argument
+ * @pkt_addr:	user address of the GPR packet to send
+ * @rsp_addr:	user buffer receiving the DSP response
+ * @pkt_len:	length of the GPR packet in bytes
+ * @rsp_len:	size of the buffer at @rsp_addr, updated with the number
+ *		of bytes copied
+ * @timeout_ms:	time to wait for the response, 0 for the default of 2 s
+ * @reserved:	must be zero
+ */
+struct audio_pkt_send_wait {
+	__u64 pkt_addr;
+	__u64 rsp_addr;
+	__u32 pkt_len;
+	__u32 rsp_len;
+	__u32 timeout_ms;
+	__u32 reserved;
+};
+
+#define AUDIO_PKT_IOCTL_SEND_WAIT _IOWR(AUDIO_IOCTL_MAGIC, 101, struct audio_pkt_send_wait)
+
+/*
+ * Shared memory references of commands written to the audio pkt device
+ * may name the dma-buf holding the memory instead of its DSP address: the
+ * reference then carries AUDIO_PKT_ADDR_FD_TAG | fd in its address msw
+ * and the offset in the dma-buf in its lsw. This covers the regions of
+ * APM_CMD_SHARED_MEM_MAP_REGIONS, the out-of-band payload of
+ * APM_CMD_SET_CFG and APM_CMD_GET_CFG, and the buffers of shared memory
+ * endpoint data commands. The dma-buf must have been mapped with
+ * IOCTL_MAP_PHYS_ADDR. GET_CFG results are written by the DSP straight
+ * to the dma-buf. Only the ADSP node accepts such references, the others
+ * fail the write with EOPNOTSUPP.
+ */
+#define AUDIO_PKT_ADDR_FD_TAG	0xFD000000
+#define AUDIO_PKT_ADDR_FD_MASK	0x00FFFFFF
+
+#define AUDIO_PKT_MAX_FILTERS 16
+
+/**
+ * struct audio_pkt_filter - AUDIO_PKT_IOCTL_SET_FILTER argument
+ * @num_opcodes:	number of valid entries in @opcodes, 0 for any opcode
+ * @num_ports:	number of valid entries in @ports, 0 for any port
+ * @opcodes:	GPR opcodes to receive
+ * @ports:	DSP ports to receive from, i.e. the destination ports of
+ *		the file's own commands
+ *
+ * Selects which DSP packets that are not a response to one of the file's
+ * own commands are delivered to it. A packet must match both lists.
+ * Setting both counts to 0 removes the filter.
+ */
+struct audio_pkt_filter {
+	__u32 num_opcodes;
+	__u32 num_ports;
+	__u32 opcodes[AUDIO_PKT_MAX_FILTERS];
+	__u32 ports[AUDIO_PKT_MAX_FILTERS];
+};
+
+#define AUDIO_PKT_IOCTL_SET_FILTER _IOW(AUDIO_IOCTL_MAGIC, 102, struct audio_pkt_filter)
+
+#define AUDIO_PKT_STREAM_PLAYBACK	0
+#define AUDIO_PKT_STREAM_CAPTURE	1
+#define AUDIO_PKT_STREAM_MAX_BUFS	64
+
+/**
+ * struct audio_pkt_stream_ctrl - control block shared with an in-kernel stream
+ * @head:	buffers filled (playback) or consumed (capture) by userspace,
+ *		free running, written by userspace
+ * @tail:	buffers given back by the DSP, free running, written by the
+ *		kernel
+ * @status:	error that stopped the stream, written by the kernel
+ * @reserved:	must be zero
+ * @len:	capture only, number of bytes the DSP wrote to each buffer,
+ *		valid once @tail has moved past the buffer
+ *
+ * Buffer n of the ring lives at buf_addr + (n % num_bufs) * buf_size.
+ * For playback the kernel submits buffers up to @head; for capture it
+ * keeps every buffer not yet consumed by userspace queued to the DSP.
+ */
+struct audio_pkt_stream_ctrl {
+	__u32 head;
+	__u32 tail;
+	__s32 status;
+	__u32 reserved;
+	__u32 len[];
+};
+
+/**
+ * struct audio_pkt_stream_cfg - AUDIO_PKT_IOCTL_STREAM_START argument
+ * @buf_addr:	DSP address of the first buffer of the ring
+ * @mem_map_handle:	handle of the shared memory mapping holding the ring
+ * @buf_size:	size of each buffer in bytes
+ * @num_bufs:	number of buffers, at most AUDIO_PKT_STREAM_MAX_BUFS
+ * @dst_port:	instance id of the shared memory endpoint module
+ * @direction:	AUDIO_PKT_STREAM_PLAYBACK or AUDIO_PKT_STREAM_CAPTURE
+ * @ctrl_fd:	dma-buf holding the struct audio_pkt_stream_ctrl
+ * @ctrl_offset:	offset of the control block in @ctrl_fd
+ * @event_fd:	eventfd signalled whenever the tail moves, -1 for none
+ * @id:		returns the stream id used by STREAM_KICK and STREAM_STOP
+ * @reserved:	must be zero
+ *
+ * The endpoint's graph must be started by userspace, and stopped before
+ * the stream is stopped or the ring unmapped.
+ */
+struct audio_pkt_stream_cfg {
+	__u64 buf_addr;
+	__u32 mem_map_handle;
+	__u32 buf_size;
+	__u32 num_bufs;
+	__u32 dst_port;
+	__u32 direction;
+	__s32 ctrl_fd;
+	__u32 ctrl_offset;
+	__s32 event_fd;
+	__u32 id;
+	__u32 reserved;
+};
+
+#define AUDIO_PKT_IOCTL_STREAM_START _IOWR(AUDIO_IOCTL_MAGIC, 103, struct audio_pkt_stream_cfg)
+/* Submit newly available buffers of the stream, argument is the stream id */
+#define AUDIO_PKT_IOCTL_STREAM_KICK _IOW(AUDIO_IOCTL_MAGIC, 104, __u32)
+#define AUDIO_PKT_IOCTL_STREAM_STOP _IOW(AUDIO_IOCTL_MAGIC, 105, __u32)
+
+/**
+ * struct audio_pkt_coalesce - AUDIO_PKT_IOCTL_SET_COALESCE argument
+ * @max_pkts:	wake the reader once this many packets are queued
+ * @max_usecs:	wake the reader at most this long after the first packet
+ *		of a batch was queued; required when @max_pkts is above 1
+ *
+ * Data path events always wake the reader at once. The defaults come
+ * from the coalesce_pkts and coalesce_usecs module parameters.
+ */
+struct audio_pkt_coalesce {
+	__u32 max_pkts;
+	__u32 max_usecs;
+};
+
+#define AUDIO_PKT_IOCTL_SET_COALESCE _IOW(AUDIO_IOCTL_MAGIC, 106, struct audio_pkt_coalesce)
+
+/*
+ * Time in us a blocking read spins on the receive queue before sleeping,
+ * 0 to disable busy polling.
+ */
+#define AUDIO_PKT_MAX_BUSY_POLL_USECS	1000
+#define AUDIO_PKT_IOCTL_SET_BUSY_POLL _IOW(AUDIO_IOCTL_MAGIC, 107, __u32)
+
+/**
+ * struct audio_pkt_stats - AUDIO_PKT_IOCTL_GET_STATS result
+ * @busy_poll_spins:	blocking reads of the file that busy polled
+ * @busy_poll_hits:	busy polls that found a packet before sleeping
+ * @tokens_expired:	commands of all files the DSP never answered
+ * @tx_congestions:	times the transport of the device refused packets
+ *			because it was full
+ * @rx_dropped_pkts:	packets dropped because the receive queue was full
+ * @rx_dropped_bytes:	bytes dropped because the receive queue was full
+ * @rx_queued_pkts:	packets currently in the receive queue
+ * @rx_queued_bytes:	bytes currently in the receive queue
+ */
+struct audio_pkt_stats {
+	__u64 busy_poll_spins;
+	__u64 busy_poll_hits;
+	__u64 tokens_expired;
+	__u64 tx_congestions;
+	__u64 rx_dropped_pkts;
+	__u64 rx_dropped_bytes;
+	__u32 rx_queued_pkts;
+	__u32 rx_queued_bytes;
+};
+
+#define AUDIO_PKT_IOCTL_GET_STATS _IOR(AUDIO_IOCTL_MAGIC, 108, struct audio_pkt_stats)
+
+/* What to drop when a packet arrives at a full receive queue */
+#define AUDIO_PKT_RX_DROP_NEWEST	0
+#define AUDIO_PKT_RX_DROP_OLDEST	1
+
+/**
+ * struct audio_pkt_rx_limit - AUDIO_PKT_IOCTL_SET_RX_LIMIT argument
+ * @max_pkts:	receive queue limit in packets
+ * @max_bytes:	receive queue limit in bytes
+ * @policy:	AUDIO_PKT_RX_DROP_NEWEST or AUDIO_PKT_RX_DROP_OLDEST;
+ *		the oldest control responses are dropped before data path
+ *		events
+ * @reserved:	must be zero
+ *
+ * Responses to AUDIO_PKT_IOCTL_SEND_WAIT and io_uring commands are never
+ * dropped. The defaults come from the rx_max_pkts and rx_max_bytes
+ * module parameters, with the newest packet dropped.
+ */
+struct audio_pkt_rx_limit {
+	__u32 max_pkts;
+	__u32 max_bytes;
+	__u32 policy;
+	__u32 reserved;
+};
+
+#define AUDIO_PKT_IOCTL_SET_RX_LIMIT _IOW(AUDIO_IOCTL_MAGIC, 109, struct audio_pkt_rx_limit)
+
+#define AUDIO_PKT_MAX_TEMPLATES		256
+#define AUDIO_PKT_MAX_TEMPLATE_PATCHES	64
+
+/**
+ * struct audio_pkt_template - AUDIO_PKT_IOCTL_TEMPLATE_ADD argument
+ * @addr:	user address of the GPR packet to keep, typically a graph
+ *		open or a calibration SET_CFG
+ * @len:	length of the packet in bytes, at most AUDIO_PKT_MAX_PKT_SIZE
+ * @handle:	returns the handle passed to TEMPLATE_SEND and TEMPLATE_DEL
+ *
+ * Templates belong to the file that added them and go away with it.
+ */
+struct audio_pkt_template {
+	__u64 addr;
+	__u32 len;
+	__u32 handle;
+};
+
+/**
+ * struct audio_pkt_template_patch - word to replace in a template copy
+ * @offset:	byte offset in the packet, 4 byte aligned and past the first
+ *		word of the GPR header
+ * @value:	new value of the word
+ */
+struct audio_pkt_template_patch {
+	__u32 offset;
+	__u32 value;
+};
+
+/**
+ * struct audio_pkt_template_send - AUDIO_PKT_IOCTL_TEMPLATE_SEND argument
+ * @patches_addr:	user address of an array of struct
+ *			audio_pkt_template_patch
+ * @handle:	template to send
+ * @num_patches:	number of entries at @patches_addr, at most
+ *			AUDIO_PKT_MAX_TEMPLATE_PATCHES
+ *
+ * A copy of the template with the patches applied is sent as if written
+ * to the device; the response is read the same way.
+ */
+struct audio_pkt_template_send {
+	__u64 patches_addr;
+	__u32 handle;
+	__u32 num_patches;
+};
+
+#define AUDIO_PKT_IOCTL_TEMPLATE_ADD _IOWR(AUDIO_IOCTL_MAGIC, 110, struct audio_pkt_template)
+#define AUDIO_PKT_IOCTL_TEMPLATE_SEND _IOW(AUDIO_IOCTL_MAGIC, 111, struct audio_pkt_template_send)
+#define AUDIO_PKT_IOCTL_TEMPLATE_DEL _IOW(AUDIO_IOCTL_MAGIC, 112, __u32)
+
+#define AUDIO_PKT_MAX_SUB_GRAPHS	32
+
+/**
+ * struct audio_pkt_graph_mgmt - AUDIO_PKT_IOCTL_GRAPH_MGMT argument
+ * @sub_graph_ids_addr:	user address of an array of sub graph ids
+ * @deadline_ns:	CLOCK_MONOTONIC time to send the command at, 0 to
+ *			send it at once
+ * @opcode:	APM_CMD_GRAPH_PREPARE, APM_CMD_GRAPH_START or
+ *		APM_CMD_GRAPH_STOP
+ * @num_sub_graphs:	number of ids at @sub_graph_ids_addr, at most
+ *			AUDIO_PKT_MAX_SUB_GRAPHS
+ * @timeout_ms:	time to wait for the DSP, 0 for the default of 2 s
+ * @status:	returns the status the DSP answered with
+ *
+ * All sub graphs are handled by one APM command, so they change state
+ * together and cost a single round trip.
+ */
+struct audio_pkt_graph_mgmt {
+	__u64 sub_graph_ids_addr;
+	__u64 deadline_ns;
+	__u32 opcode;
+	__u32 num_sub_graphs;
+	__u32 timeout_ms;
+	__u32 status;
+};
+
+#define AUDIO_PKT_IOCTL_GRAPH_MGMT _IOWR(AUDIO_IOCTL_MAGIC, 113, struct audio_pkt_graph_mgmt)
+
+/* Transmit scheduling classes, real-time queues are always served first */
+#define AUDIO_PKT_TX_CLASS_RT		0
+#define AUDIO_PKT_TX_CLASS_NORMAL	1
+#define AUDIO_PKT_TX_NUM_CLASSES	2
+
+#define AUDIO_PKT_MAX_TX_WEIGHT		64
+
+/**
+ * struct audio_pkt_tx_sched - AUDIO_PKT_IOCTL_SET_TX_SCHED argument
+ * @weight:	share of the control command bandwidth of the file relative
+ *		to the other files of its class, 1 to AUDIO_PKT_MAX_TX_WEIGHT,
+ *		8 by default
+ * @sched_class:	AUDIO_PKT_TX_CLASS_NORMAL by default, or
+ *			AUDIO_PKT_TX_CLASS_RT with CAP_SYS_NICE
+ *
+ * Within a class, data path commands of every file go ahead of control
+ * commands, which are shared between files in proportion to weight.
+ */
+struct audio_pkt_tx_sched {
+	__u32 weight;
+	__u32 sched_class;
+};
+
+#define AUDIO_PKT_IOCTL_SET_TX_SCHED _IOW(AUDIO_IOCTL_MAGIC, 114, struct audio_pkt_tx_sched)
+
+/*
+ * Events read from every open file of an audio pkt device, as GPR
+ * packets from the APM with token 0 and a single payload word, the
+ * number of times the DSP restarted.
+ *
+ * AUDIO_PKT_EVENT_DSP_DOWN: the DSP crashed. Commands in flight failed
+ * with ENETRESET, streams stopped with -ENETRESET in their status, and
+ * sends fail with ENETRESET until AUDIO_PKT_EVENT_DSP_UP.
+ *
+ * AUDIO_PKT_EVENT_DSP_UP: the DSP is back and the memory maps of the file
+ * were restored under the handles it knows them by. Graphs must be
+ * opened again.
+ */
+#define AUDIO_PKT_EVENT_DSP_DOWN	0xFF000001
+#define AUDIO_PKT_EVENT_DSP_UP		0xFF000002
+
+/*
+ * DSP states of an audio pkt device. Every change bumps the sequence
+ * number, raises POLLPRI on every open file until the file reads the
+ * state back, and sends a KOBJ_CHANGE uevent with DSP_STATE=OFFLINE,
+ * BOOTING or READY.
+ *
+ * AUDIO_PKT_DSP_STATE_OFFLINE: the DSP is down, sends fail with ENETRESET.
+ * AUDIO_PKT_DSP_STATE_BOOTING: the DSP is up but its APM is not ready yet,
+ * or the memory maps of the open files are being restored.
+ * AUDIO_PKT_DSP_STATE_READY: graphs may be opened.
+ */
+#define AUDIO_PKT_DSP_STATE_OFFLINE	0
+#define AUDIO_PKT_DSP_STATE_BOOTING	1
+#define AUDIO_PKT_DSP_STATE_READY	2
+
+/**
+ * struct audio_pkt_dsp_state - AUDIO_PKT_IOCTL_GET_DSP_STATE argument
+ * @state:	one of AUDIO_PKT_DSP_STATE_*
+ * @seq:	number of state changes since the device was created
+ * @restarts:	number of times the DSP restarted
+ * @reserved:	zero
+ *
+ * Reading the state clears POLLPRI on the file until the next change.
+ */
+struct audio_pkt_dsp_state {
+	__u32 state;
+	__u32 seq;
+	__u32 restarts;
+	__u32 reserved;
+};
+
+#define AUDIO_PKT_IOCTL_GET_DSP_STATE _IOR(AUDIO_IOCTL_MAGIC, 115, struct audio_pkt_dsp_state)
+
+/* io_uring command opcodes (sqe->cmd_op) of the audio pkt device */
+#define AUDIO_PKT_URING_CMD_SEND	1
+#define AUDIO_PKT_URING_CMD_RECV	2
+
+/**
+ * struct audio_pkt_uring_cmd - io_uring command payload (sqe->cmd)
+ * @addr:	user buffer; for SEND it holds the GPR packet to send and
+ *		receives the matching DSP response, for RECV it receives
+ *		the next DSP packet
+ * @len:	size of the buffer at @addr
+ * @reserved:	must be zero
+ *
+ * The completion result is the number of bytes copied to @addr.
+ */
+struct audio_pkt_uring_cmd {
+	__u64 addr;
+	__u32 len;
+	__u32 reserved;
+};
+
 #endif